@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of the per message paths of the router.
+ *
+ * Each case is run with a doubling number of packets until it takes at least
+ * the minimum run time, then reported as one tab separated line:
+ *
+ *   <case> <packet bytes> <escape %> <packets> <ns/packet> <MB/s>
+ *
+ * following a header line starting with '#'. The escape percentage is the
+ * share of message bytes needing HDLC escaping. Only the operation itself is
+ * timed, not the preparation of its input or the disposal of its output.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "circ_buf.h"
+#include "diag.h"
+#include "hdlc.h"
+#include "list.h"
+#include "mbuf.h"
+#include "util.h"
+#include "watch.h"
+
+#define BENCH_MIN_TIME_MS	50
+#define BENCH_RING_SIZE		(1024 * 1024)
+#define BENCH_QUEUE_DEPTH	256
+
+/**
+ * struct bench_ctx - input of a benchmark case
+ * @size:	length of the message
+ * @escapes:	percentage of message bytes needing escaping
+ * @msg:	the message
+ * @frame:	the message HDLC encoded
+ * @frame_len:	length of @frame
+ * @dst:	scratch buffer, large enough for any encoding of @msg
+ */
+struct bench_ctx {
+	size_t size;
+	unsigned int escapes;
+
+	uint8_t *msg;
+	uint8_t *frame;
+	size_t frame_len;
+	uint8_t *dst;
+};
+
+/**
+ * struct bench - a benchmark case
+ * @name:	name of the case, as reported
+ * @escapes:	true if the case is run for each escape density
+ * @run:	perform @count operations, returning the time spent in them
+ */
+struct bench {
+	const char *name;
+	bool escapes;
+	uint64_t (*run)(struct bench_ctx *ctx, unsigned long count);
+};
+
+static const size_t bench_sizes[] = { 16, 64, 256, 1024, 4096, 16384 };
+static const unsigned int bench_escapes[] = { 0, 1, 10, 50 };
+
+/* Results are accumulated here, so that the operations aren't elided */
+static volatile uint64_t bench_sink;
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Deterministic pseudo random numbers, for runs to be comparable */
+static uint32_t bench_random(void)
+{
+	static uint32_t state = 2463534242U;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	return state;
+}
+
+static void bench_ctx_init(struct bench_ctx *ctx, size_t size,
+			   unsigned int escapes)
+{
+	uint8_t ch;
+	size_t i;
+
+	ctx->size = size;
+	ctx->escapes = escapes;
+	ctx->msg = malloc(size);
+	ctx->frame = malloc((size + 2) * 2 + 1);
+	ctx->dst = malloc((size + 2) * 2 + 1);
+	if (!ctx->msg || !ctx->frame || !ctx->dst)
+		err(1, "failed to allocate benchmark buffers");
+
+	for (i = 0; i < size; i++) {
+		if (bench_random() % 100 < escapes) {
+			ctx->msg[i] = i & 1 ? 0x7d : 0x7e;
+		} else {
+			do {
+				ch = bench_random();
+			} while (ch == 0x7d || ch == 0x7e);
+
+			ctx->msg[i] = ch;
+		}
+	}
+
+	ctx->frame_len = hdlc_encode_buf(ctx->frame, ctx->msg, size);
+}
+
+static void bench_ctx_release(struct bench_ctx *ctx)
+{
+	free(ctx->msg);
+	free(ctx->frame);
+	free(ctx->dst);
+}
+
+static uint64_t bench_hdlc_encode(struct bench_ctx *ctx, unsigned long count)
+{
+	uint64_t start = bench_now();
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+		bench_sink += hdlc_encode_buf(ctx->dst, ctx->msg, ctx->size);
+
+	return bench_now() - start;
+}
+
+static uint64_t bench_hdlc_decode(struct bench_ctx *ctx, unsigned long count)
+{
+	struct hdlc_decoder decoder = {};
+	struct circ_buf ring;
+	unsigned long batch;
+	unsigned long n = 0;
+	uint64_t elapsed = 0;
+	uint64_t start;
+	size_t msglen;
+	void *msg;
+
+	circ_init(&ring, "bench", BENCH_RING_SIZE);
+
+	while (n < count) {
+		/* Fill the ring with as many frames as fit, then decode them */
+		for (batch = 0; n + batch < count; batch++) {
+			if (CIRC_SPACE(&ring) < ctx->frame_len)
+				break;
+
+			circ_write(&ring, ctx->frame, ctx->frame_len);
+		}
+
+		start = bench_now();
+		while ((msg = hdlc_decode_one(&decoder, &ring, &msglen)) != NULL) {
+			bench_sink += msglen;
+			n++;
+		}
+		elapsed += bench_now() - start;
+
+		if (CIRC_CNT(&ring))
+			errx(1, "%s: frames left undecoded", __func__);
+	}
+
+	hdlc_decoder_release(&decoder);
+	circ_release(&ring);
+
+	return elapsed;
+}
+
+static uint64_t bench_crc(struct bench_ctx *ctx, unsigned long count)
+{
+	uint64_t start = bench_now();
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+		bench_sink += hdlc_crc_update(HDLC_CRC_INIT, ctx->msg, ctx->size);
+
+	return bench_now() - start;
+}
+
+static uint64_t bench_circ_read(struct bench_ctx *ctx, unsigned long count)
+{
+	struct circ_buf ring;
+	uint64_t elapsed = 0;
+	uint64_t start;
+	unsigned long i;
+	ssize_t n;
+	int fd[2];
+
+	if (pipe2(fd, O_NONBLOCK) < 0)
+		err(1, "failed to create pipe");
+
+	circ_init(&ring, "bench", BENCH_RING_SIZE);
+
+	for (i = 0; i < count; i++) {
+		n = write(fd[1], ctx->msg, ctx->size);
+		if (n != (ssize_t)ctx->size)
+			err(1, "failed to write pipe");
+
+		start = bench_now();
+		n = circ_read(fd[0], &ring);
+		elapsed += bench_now() - start;
+
+		if (CIRC_CNT(&ring) != ctx->size)
+			errx(1, "%s: short read", __func__);
+
+		circ_consume(&ring, CIRC_CNT(&ring));
+	}
+
+	circ_release(&ring);
+	close(fd[0]);
+	close(fd[1]);
+
+	return elapsed;
+}
+
+static uint64_t bench_mbuf_alloc(struct bench_ctx *ctx, unsigned long count)
+{
+	uint64_t start = bench_now();
+	struct mbuf *mbuf;
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		mbuf = mbuf_alloc(ctx->size);
+		if (!mbuf)
+			errx(1, "failed to allocate mbuf");
+
+		mbuf_free(mbuf);
+	}
+
+	return bench_now() - start;
+}
+
+static uint64_t bench_queue_push_flow(struct bench_ctx *ctx,
+				      unsigned long count)
+{
+	struct list_head queue = LIST_INIT(queue);
+	struct watch_flow *flow;
+	uint64_t elapsed = 0;
+	unsigned long batch;
+	unsigned long n = 0;
+	struct mbuf *mbuf;
+	uint64_t start;
+
+	flow = watch_flow_new();
+	if (!flow)
+		err(1, "failed to allocate flow");
+
+	while (n < count) {
+		batch = MIN(count - n, BENCH_QUEUE_DEPTH);
+
+		start = bench_now();
+		for (n += batch; batch; batch--)
+			queue_push_flow(&queue, ctx->msg, ctx->size, flow);
+		elapsed += bench_now() - start;
+
+		while (!list_empty(&queue)) {
+			mbuf = list_entry_first(&queue, struct mbuf, node);
+			list_del(&mbuf->node);
+			watch_flow_dec(flow, mbuf_len(mbuf));
+			mbuf_free(mbuf);
+		}
+	}
+
+	free(flow);
+
+	return elapsed;
+}
+
+static uint64_t bench_nhdlc_encode(struct bench_ctx *ctx, unsigned long count)
+{
+	uint64_t start = bench_now();
+	struct mbuf *frame;
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		frame = nhdlc_encode_mbuf(ctx->msg, ctx->size);
+		if (!frame)
+			errx(1, "failed to frame message");
+
+		mbuf_free(frame);
+	}
+
+	return bench_now() - start;
+}
+
+static uint64_t bench_nhdlc_frame(struct bench_ctx *ctx, unsigned long count)
+{
+	struct mbuf *frame;
+	struct mbuf *mbuf;
+	unsigned long i;
+	uint64_t start;
+
+	mbuf = diag_mbuf_alloc(ctx->size);
+	if (!mbuf)
+		errx(1, "failed to allocate mbuf");
+
+	memcpy(mbuf_put(mbuf, ctx->size), ctx->msg, ctx->size);
+
+	start = bench_now();
+	for (i = 0; i < count; i++) {
+		frame = nhdlc_frame_mbuf(mbuf);
+		if (!frame)
+			errx(1, "failed to frame message");
+
+		mbuf_free(frame);
+	}
+
+	mbuf_free(mbuf);
+
+	return bench_now() - start;
+}
+
+static const struct bench benches[] = {
+	{ "hdlc_encode", true, bench_hdlc_encode },
+	{ "hdlc_decode_one", true, bench_hdlc_decode },
+	{ "hdlc_crc", false, bench_crc },
+	{ "circ_read", false, bench_circ_read },
+	{ "mbuf_alloc", false, bench_mbuf_alloc },
+	{ "queue_push_flow", false, bench_queue_push_flow },
+	{ "nhdlc_encode_mbuf", false, bench_nhdlc_encode },
+	{ "nhdlc_frame_mbuf", false, bench_nhdlc_frame },
+};
+
+static void bench_run(const struct bench *bench, size_t size,
+		      unsigned int escapes, uint64_t min_time)
+{
+	struct bench_ctx ctx;
+	unsigned long count;
+	uint64_t elapsed;
+
+	bench_ctx_init(&ctx, size, escapes);
+
+	for (count = 1; ; count *= 2) {
+		elapsed = bench->run(&ctx, count);
+		if (elapsed >= min_time)
+			break;
+	}
+
+	printf("%s\t%zu\t%u\t%lu\t%.1f\t%.1f\n", bench->name, size, escapes,
+	       count, (double)elapsed / count,
+	       (double)size * count * 1000 / elapsed);
+	fflush(stdout);
+
+	bench_ctx_release(&ctx);
+}
+
+static bool bench_selected(const struct bench *bench, int argc, char **argv)
+{
+	int i;
+
+	if (!argc)
+		return true;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], bench->name))
+			return true;
+	}
+
+	return false;
+}
+
+static void usage(void)
+{
+	size_t i;
+
+	fprintf(stderr,
+		"Microbenchmarks of the diag router\n"
+		"\n"
+		"usage: diag-bench [-h] [-t ms] [case...]\n"
+		"\n"
+		"options:\n"
+		"   -h   show this usage\n"
+		"   -t   <ms> minimum run time of each case, default %d\n"
+		"\n"
+		"cases:\n", BENCH_MIN_TIME_MS);
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, "   %s\n", benches[i].name);
+
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t min_time = BENCH_MIN_TIME_MS * 1000000ULL;
+	const struct bench *bench;
+	size_t i;
+	size_t j;
+	size_t k;
+	int c;
+
+	for (;;) {
+		c = getopt(argc, argv, "ht:");
+		if (c < 0)
+			break;
+		switch (c) {
+		case 't':
+			min_time = strtoull(optarg, NULL, 0) * 1000000ULL;
+			if (!min_time)
+				usage();
+			break;
+		default:
+		case 'h':
+			usage();
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	printf("# case\tsize\tescape_pct\tpackets\tns_per_packet\tmb_per_s\n");
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		bench = &benches[i];
+		if (!bench_selected(bench, argc, argv))
+			continue;
+
+		for (j = 0; j < ARRAY_SIZE(bench_sizes); j++) {
+			if (!bench->escapes) {
+				bench_run(bench, bench_sizes[j], 0, min_time);
+				continue;
+			}
+
+			for (k = 0; k < ARRAY_SIZE(bench_escapes); k++)
+				bench_run(bench, bench_sizes[j],
+					  bench_escapes[k], min_time);
+		}
+	}
+
+	return 0;
+}
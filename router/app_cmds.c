@@ -31,6 +31,7 @@
  */
 #include <err.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -38,7 +39,10 @@
 #include "diag_cntl.h"
 #include "dm.h"
 #include "hdlc.h"
+#include "mbuf.h"
+#include "peripheral.h"
 #include "util.h"
+#include "watch.h"
 
 #define DIAG_CMD_KEEP_ALIVE_SUBSYS	50
 #define DIAG_CMD_KEEP_ALIVE_CMD		3
@@ -57,6 +61,7 @@
 
 #define DIAG_CMD_OP_HDLC_DISABLE	0x218
 #define DIAG_CMD_DIAG_GET_DIAG_ID	0x222
+#define DIAG_CMD_OP_LOOP_STATS		0x230
 
 static int handle_diag_version(struct diag_client *client, const void *buf,
 			       size_t len)
@@ -193,6 +198,54 @@ static int handle_hdlc_disable_cmd(struct diag_client *client, const void *buf,
 	return ret;
 }
 
+static int handle_loop_stats(struct diag_client *client, const void *buf,
+			     size_t len)
+{
+	struct loop_stats_req {
+		uint8_t cmd_code;
+		uint8_t subsys_id;
+		uint16_t subsys_cmd_code;
+	} __packed;
+	uint8_t *resp;
+	size_t resp_len;
+	size_t size;
+	char *text;
+	FILE *fp;
+	int ret;
+
+	if (!buf || len < sizeof(struct loop_stats_req))
+		return -EMSGSIZE;
+
+	fp = open_memstream(&text, &size);
+	if (!fp)
+		return -errno;
+
+	watch_dump_stats(fp);
+	mbuf_dump_stats(fp);
+	dm_dump_stats(fp);
+	peripheral_dump_stats(fp);
+	fclose(fp);
+
+	/* Truncate the report to what fits in a single response */
+	resp_len = MIN(sizeof(struct loop_stats_req) + size, DIAG_MAX_RSP_SIZE);
+	resp = malloc(resp_len);
+	if (!resp) {
+		free(text);
+		return -ENOMEM;
+	}
+
+	memcpy(resp, buf, sizeof(struct loop_stats_req));
+	memcpy(resp + sizeof(struct loop_stats_req), text,
+	       resp_len - sizeof(struct loop_stats_req));
+
+	ret = dm_send(client, resp, resp_len);
+
+	free(resp);
+	free(text);
+
+	return ret;
+}
+
 void register_app_cmds(void)
 {
 	register_fallback_cmd(DIAG_CMD_DIAG_VERSION_ID, handle_diag_version);
@@ -204,4 +257,6 @@ void register_app_cmds(void)
 				     DIAG_CMD_DIAG_GET_DIAG_ID, handle_diag_id);
 	register_fallback_subsys_cmd(DIAG_CMD_DIAG_SUBSYS,
 				     DIAG_CMD_OP_HDLC_DISABLE, handle_hdlc_disable_cmd);
+	register_fallback_subsys_cmd(DIAG_CMD_DIAG_SUBSYS,
+				     DIAG_CMD_OP_LOOP_STATS, handle_loop_stats);
 }
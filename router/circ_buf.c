@@ -29,25 +29,180 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <err.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "circ_buf.h"
+#include "list.h"
+
+/**
+ * struct circ_size_config - receive buffer size override
+ * @name:	name of the peripheral or client
+ * @size:	size of the buffer, in bytes
+ * @node:	entry in circ_size_configs
+ */
+struct circ_size_config {
+	char *name;
+	size_t size;
+	struct list_head node;
+};
+
+static struct list_head circ_size_configs = LIST_INIT(circ_size_configs);
+
+/**
+ * circ_set_size() - configure the receive buffer size of a peripheral or client
+ * @name:	name of the peripheral or client
+ * @size:	size of the buffer, rounded up to a power of two number of pages
+ *
+ * Overrides the size chosen by the owner of the buffer, for buffers
+ * initialized after the call.
+ */
+void circ_set_size(const char *name, size_t size)
+{
+	struct circ_size_config *config;
+
+	config = calloc(1, sizeof(*config));
+	if (!config)
+		err(1, "failed to allocate receive buffer configuration");
+
+	config->name = strdup(name);
+	config->size = size;
+	list_add(&circ_size_configs, &config->node);
+}
+
+static size_t circ_size_of(const char *name, size_t size)
+{
+	struct circ_size_config *config;
+	size_t page_size;
+	size_t rounded;
+
+	list_for_each_entry(config, &circ_size_configs, node) {
+		if (name && !strcmp(config->name, name))
+			size = config->size;
+	}
+
+	/* The mirror is made of whole pages, and indices are masked */
+	page_size = sysconf(_SC_PAGESIZE);
+	for (rounded = page_size; rounded < size; rounded <<= 1)
+		;
+
+	return rounded;
+}
+
+/**
+ * circ_init() - initialize a circular buffer
+ * @buf:	circ_buf object to initialize
+ * @name:	peripheral or client the buffer is used by
+ * @size:	size of the buffer, unless configured for @name
+ *
+ * No memory is allocated until the buffer is first used.
+ */
+void circ_init(struct circ_buf *buf, const char *name, size_t size)
+{
+	buf->buf = NULL;
+	buf->size = circ_size_of(name, size);
+	buf->head = 0;
+	buf->tail = 0;
+}
+
+/* Back the buffer by a memfd, with its pages mapped twice in a row */
+static int circ_map(struct circ_buf *buf)
+{
+	size_t size = buf->size;
+	void *base;
+	void *ptr;
+	int ret;
+	int fd;
+
+	fd = memfd_create("circ_buf", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = ftruncate(fd, size);
+	if (ret < 0)
+		goto err_close;
+
+	/* Reserve room for both mappings, then map the pages over it */
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto err_close;
+
+	ptr = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		   fd, 0);
+	if (ptr == MAP_FAILED)
+		goto err_unmap;
+
+	ptr = mmap((char *)base + size, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, fd, 0);
+	if (ptr == MAP_FAILED)
+		goto err_unmap;
+
+	close(fd);
+
+	buf->buf = base;
+	buf->head = 0;
+	buf->tail = 0;
+
+	return 0;
+
+err_unmap:
+	ret = -errno;
+	munmap(base, 2 * size);
+	close(fd);
+	return ret;
+
+err_close:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/**
+ * circ_release() - release the memory of a circular buffer
+ * @buf:	circ_buf object
+ *
+ * Buffered data is discarded, the buffer is allocated again on next use.
+ */
+void circ_release(struct circ_buf *buf)
+{
+	if (!buf->buf)
+		return;
+
+	munmap(buf->buf, 2 * buf->size);
+	buf->buf = NULL;
+	buf->head = 0;
+	buf->tail = 0;
+}
 
 /**
  * circ_read() - read data into circular buffer
  * @fd:		non-blocking file descriptor to read
  * @buf:	circ_buf object to write to
  *
- * Return: 0 if fifo is full or fd depleted, negative errno on failure
+ * Return: 0 if fifo is full or fd depleted, negative on failure or end of
+ * file, with errno set
  */
 ssize_t circ_read(int fd, struct circ_buf *buf)
 {
 	size_t space;
 	ssize_t n;
+	int ret;
+
+	if (!buf->buf) {
+		ret = circ_map(buf);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+	}
 
 	do {
-		space = CIRC_SPACE_TO_END(buf);
+		space = CIRC_SPACE(buf);
 		if (!space)
 			return 0;
 
@@ -55,8 +210,34 @@ ssize_t circ_read(int fd, struct circ_buf *buf)
 		if (n < 0)
 			return n;
 
-		buf->head = (buf->head + n) & (HDLC_BUF_SIZE - 1);
+		if (!n) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		buf->head = (buf->head + n) & (buf->size - 1);
 	} while (n == space);
 
 	return 0;
 }
+
+/**
+ * circ_write() - copy data into circular buffer
+ * @buf:	circ_buf object to write to
+ * @src:	data to copy
+ * @len:	number of bytes to copy
+ *
+ * Return: number of bytes copied, less than @len if the buffer filled up
+ */
+size_t circ_write(struct circ_buf *buf, const void *src, size_t len)
+{
+	if (!buf->buf && circ_map(buf) < 0)
+		return 0;
+
+	len = MIN(len, CIRC_SPACE(buf));
+
+	memcpy(buf->buf + buf->head, src, len);
+	buf->head = (buf->head + len) & (buf->size - 1);
+
+	return len;
+}
@@ -31,20 +31,41 @@
 #ifndef __CIRC_BUF_H__
 #define __CIRC_BUF_H__
 
+#include <sys/types.h>
+
 #include "util.h"
 
 #define HDLC_BUF_SIZE 16384
 
+/*
+ * The @size bytes of the buffer are mapped twice, back to back, so the data
+ * between @tail and @head, as well as the space between @head and @tail, is
+ * always contiguous in memory, even when it wraps. The mapping is made by
+ * the first read or write, @buf is NULL until then.
+ */
 struct circ_buf {
-	char buf[HDLC_BUF_SIZE];
+	char *buf;
+	size_t size;
 	size_t head;
 	size_t tail;
 };
 
-#define CIRC_SPACE(buf) (((buf)->tail - (buf)->head - 1) & (HDLC_BUF_SIZE - 1))
+#define CIRC_CNT(buf) (((buf)->head - (buf)->tail) & ((buf)->size - 1))
+
+#define CIRC_SPACE(buf) (((buf)->tail - (buf)->head - 1) & ((buf)->size - 1))
+
+/* Start of the data, CIRC_CNT() bytes are readable from here */
+#define CIRC_DATA(circ) ((circ)->buf + (circ)->tail)
 
-#define CIRC_SPACE_TO_END(buf) MIN(CIRC_SPACE(buf), HDLC_BUF_SIZE - (buf)->head)
+static inline void circ_consume(struct circ_buf *buf, size_t n)
+{
+	buf->tail = (buf->tail + n) & (buf->size - 1);
+}
 
+void circ_set_size(const char *name, size_t size);
+void circ_init(struct circ_buf *buf, const char *name, size_t size);
+void circ_release(struct circ_buf *buf);
 ssize_t circ_read(int fd, struct circ_buf *buf);
+size_t circ_write(struct circ_buf *buf, const void *src, size_t len);
 
 #endif
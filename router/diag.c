@@ -29,8 +29,13 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <err.h>
 #include <errno.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,7 +43,9 @@
 #include <string.h>
 
 #include "diag.h"
+#include "dm.h"
 #include "hdlc.h"
+#include "ingress.h"
 #include "masks.h"
 #include "mbuf.h"
 #include "peripheral.h"
@@ -47,70 +54,227 @@
 
 struct list_head diag_cmds = LIST_INIT(diag_cmds);
 
-void queue_push_nhdlc_flow(struct list_head *queue, const void *msg, size_t msglen,
-			struct watch_flow *flow)
+static int parse_flow_limits(char *arg)
 {
-	size_t len;
-	size_t off = 0;
-	struct mbuf *mbuf = NULL;
-	uint8_t *ptr = NULL;
+	struct watch_flow_limits limits;
+	char *name;
+	char *spec;
+	int n;
 
-	len = msglen + sizeof(struct diag_pkt_frame) + sizeof(uint8_t);
+	name = strtok(arg, "=");
+	spec = strtok(NULL, "");
+	if (!name || !spec)
+		return -EINVAL;
 
-	mbuf = mbuf_alloc(len);
-	if (!mbuf) {
-		warnx("Diag: %s: failed to allocate memory", __func__);
-		return;
+	n = sscanf(spec, "%u,%u,%zu,%zu", &limits.packets_high,
+		   &limits.packets_low, &limits.bytes_high, &limits.bytes_low);
+	if (n != 4 || limits.packets_low > limits.packets_high ||
+	    limits.bytes_low > limits.bytes_high)
+		return -EINVAL;
+
+	peripheral_set_flow_limits(name, &limits);
+
+	return 0;
+}
+
+static int parse_budget(char *arg)
+{
+	struct peripheral_budget budget;
+	char *name;
+	char *spec;
+	int n;
+
+	name = strtok(arg, "=");
+	spec = strtok(NULL, "");
+	if (!name || !spec)
+		return -EINVAL;
+
+	n = sscanf(spec, "%u,%zu", &budget.packets, &budget.bytes);
+	if (n != 2)
+		return -EINVAL;
+
+	peripheral_set_budget(name, &budget);
+
+	return 0;
+}
+
+static int parse_recv_size(char *arg)
+{
+	char *name;
+	char *spec;
+	size_t size;
+	int n;
+
+	name = strtok(arg, "=");
+	spec = strtok(NULL, "");
+	if (!name || !spec)
+		return -EINVAL;
+
+	n = sscanf(spec, "%zu", &size);
+	if (n != 1 || !size)
+		return -EINVAL;
+
+	circ_set_size(name, size);
+
+	return 0;
+}
+
+static int parse_mem_budget(char *arg)
+{
+	enum dm_drop_policy policy = DM_DROP_NEWEST;
+	char policy_name[8] = "newest";
+	size_t client;
+	size_t total;
+	int n;
+
+	n = sscanf(arg, "%zu,%zu,%7s", &total, &client, policy_name);
+	if (n < 2)
+		return -EINVAL;
+
+	if (!strcmp(policy_name, "newest"))
+		policy = DM_DROP_NEWEST;
+	else if (!strcmp(policy_name, "oldest"))
+		policy = DM_DROP_OLDEST;
+	else if (!strcmp(policy_name, "class"))
+		policy = DM_DROP_CLASS;
+	else
+		return -EINVAL;
+
+	dm_set_budget(total, client, policy);
+
+	return 0;
+}
+
+/*
+ * Pool reservations are made once all options are parsed, so that they are
+ * carved from the arena if one is requested.
+ */
+#define DIAG_MAX_POOL_RESERVATIONS	16
+
+static struct {
+	size_t size;
+	unsigned int count;
+} pool_reservations[DIAG_MAX_POOL_RESERVATIONS];
+static int pool_reservation_count;
+
+static int parse_pool_reserve(char *arg)
+{
+	unsigned int count;
+	size_t size;
+	int n;
+
+	if (pool_reservation_count == DIAG_MAX_POOL_RESERVATIONS)
+		return -ENOSPC;
+
+	n = sscanf(arg, "%zu,%u", &size, &count);
+	if (n != 2)
+		return -EINVAL;
+
+	pool_reservations[pool_reservation_count].size = size;
+	pool_reservations[pool_reservation_count].count = count;
+	pool_reservation_count++;
+
+	return 0;
+}
+
+static int parse_cpus(char *arg, cpu_set_t *cpus)
+{
+	unsigned int first;
+	unsigned int last;
+	char *token;
+	int n;
+
+	CPU_ZERO(cpus);
+
+	for (token = strtok(arg, ","); token; token = strtok(NULL, ",")) {
+		n = sscanf(token, "%u-%u", &first, &last);
+		if (n == 1)
+			last = first;
+		else if (n != 2 || last < first)
+			return -EINVAL;
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, cpus);
 	}
 
-	ptr = mbuf_put(mbuf, len);
-	if (!ptr) {
-		warnx("Diag: %s: invalid ptr, dropping pkt of len: %zu\n", __func__, len);
-		free(mbuf);
-		return;
+	return CPU_COUNT(cpus) ? 0 : -EINVAL;
+}
+
+static void diag_pool_init(size_t arena_size)
+{
+	int ret;
+	int i;
+
+	if (arena_size) {
+		ret = mbuf_arena_init(arena_size);
+		if (ret < 0)
+			errx(1, "failed to set up mbuf arena: %s", strerror(-ret));
 	}
 
-	struct diag_pkt_frame *header = (struct diag_pkt_frame *)ptr;
+	for (i = 0; i < pool_reservation_count; i++) {
+		ret = mbuf_pool_reserve(pool_reservations[i].size,
+					pool_reservations[i].count);
+		if (ret < 0)
+			errx(1, "failed to reserve %u buffers of %zu bytes",
+			     pool_reservations[i].count,
+			     pool_reservations[i].size);
+	}
+}
 
-	header->start = NHDLC_CONTROL_CHAR;
-	header->version = 1;
-	header->length = msglen;
+/*
+ * Settle the memory and scheduling of the router before any peripheral is
+ * opened, ingress threads inherit both the CPU affinity and the policy.
+ */
+static void diag_rt_init(bool lock_memory, cpu_set_t *cpus, int priority)
+{
+	struct sched_param param = { .sched_priority = priority };
 
-	off += sizeof(struct diag_pkt_frame);
-	/* copy the actual packet */
-	memcpy(ptr + off, msg, msglen);
-	off += msglen; 
+	if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		err(1, "failed to lock memory");
 
-	((uint8_t *)ptr)[off] = NHDLC_CONTROL_CHAR;
-	off += sizeof(uint8_t);
+	if (cpus && sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+		err(1, "failed to set CPU affinity");
 
-	mbuf->offset = off;
-	mbuf->flow = flow;
-	
-	watch_flow_inc(flow);
-	list_add(queue, &mbuf->node);
+	if (priority && sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+		err(1, "failed to set SCHED_FIFO priority %d", priority);
 }
 
-void queue_push_flow(struct list_head *queue, const void *msg, size_t msglen,
-		     struct watch_flow *flow)
+static int diag_sigusr1(int fd, void *data)
 {
-	struct mbuf *mbuf;
-	void *ptr;
-
-	mbuf = mbuf_alloc(msglen);
-	ptr = mbuf_put(mbuf, msglen);
-	memcpy(ptr, msg, msglen);
+	struct signalfd_siginfo si;
+	ssize_t n;
 
-	mbuf->flow = flow;
+	n = read(fd, &si, sizeof(si));
+	if (n != sizeof(si))
+		return 0;
 
-	watch_flow_inc(flow);
+	watch_dump_stats(stderr);
+	mbuf_dump_stats(stderr);
+	dm_dump_stats(stderr);
+	peripheral_dump_stats(stderr);
 
-	list_add(queue, &mbuf->node);
+	return 0;
 }
 
-void queue_push(struct list_head *queue, const void *msg, size_t msglen)
+static void diag_stats_init(void)
 {
-	queue_push_flow(queue, msg, msglen, NULL);
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+
+	/* Block before any ingress thread inherits the signal mask */
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		warn("failed to create signalfd");
+		return;
+	}
+
+	watch_add_readfd(fd, diag_sigusr1, NULL, NULL);
+	watch_set_name(fd, "SIGUSR1");
 }
 
 static void usage(void)
@@ -118,11 +282,24 @@ static void usage(void)
 	fprintf(stderr,
 		"User space application for diag interface\n"
 		"\n"
-		"usage: diag [-hsu]\n"
+		"usage: diag [-abcFfhlmpRrstu]\n"
 		"\n"
 		"options:\n"
+		"   -a   <bytes> carve the buffer pools from a locked arena of this size,\n"
+		"        messages are dropped rather than the heap used when exhausted\n"
+		"   -b   <peripheral>=<packets>,<bytes> read per data callback, 0 for no limit\n"
+		"   -c   <cpu list> run on these CPUs, e.g. 0,2-3\n"
+		"   -F   <bytes> largest HDLC message to decode, larger ones are dropped\n"
+		"   -f   <peripheral>=<packets high>,<packets low>,<bytes high>,<bytes low>\n"
 		"   -h   show this usage\n"
+		"   -l   lock all memory of the router\n"
+		"   -m   <total bytes>,<bytes per client>[,newest|oldest|class] DM queue\n"
+		"        budgets, 0 for no limit, and what to drop when exceeded\n"
+		"   -p   <size>,<count> preallocate count buffers of size bytes\n"
+		"   -R   <priority> run with SCHED_FIFO real-time priority\n"
+		"   -r   <peripheral or client>=<bytes> receive buffer size\n"
 		"   -s   <socket address[:port]>\n"
+		"   -t   read peripheral data channels on dedicated threads\n"
 		"   -u   <uart device name[@baudrate]>\n"
 	);
 
@@ -135,21 +312,79 @@ int main(int argc, char **argv)
 	int host_port = DEFAULT_SOCKET_PORT;
 	char *uartdev = NULL;
 	int baudrate = DEFAULT_BAUD_RATE;
+	cpu_set_t *cpus = NULL;
+	bool lock_memory = false;
+	size_t arena_size = 0;
+	size_t max_frame;
+	int priority = 0;
 	char *token;
 	int ret;
 	int c;
 
 	for (;;) {
-		c = getopt(argc, argv, "hs:u:");
+		c = getopt(argc, argv, "a:b:c:F:f:hlm:p:R:r:s:tu:");
 		if (c < 0)
 			break;
 		switch (c) {
+		case 'a':
+			arena_size = strtoul(optarg, NULL, 0);
+			if (!arena_size)
+				usage();
+			break;
+		case 'b':
+			ret = parse_budget(strdup(optarg));
+			if (ret < 0)
+				usage();
+			break;
+		case 'c':
+			cpus = malloc(sizeof(*cpus));
+			if (!cpus || parse_cpus(strdup(optarg), cpus) < 0)
+				usage();
+			break;
+		case 'F':
+			max_frame = strtoul(optarg, NULL, 0);
+			if (!max_frame)
+				usage();
+			hdlc_set_max_frame(max_frame);
+			break;
+		case 'f':
+			ret = parse_flow_limits(strdup(optarg));
+			if (ret < 0)
+				usage();
+			break;
+		case 'l':
+			lock_memory = true;
+			break;
+		case 'm':
+			ret = parse_mem_budget(optarg);
+			if (ret < 0)
+				usage();
+			break;
+		case 'p':
+			ret = parse_pool_reserve(optarg);
+			if (ret < 0)
+				usage();
+			break;
+		case 'R':
+			priority = atoi(optarg);
+			if (priority < sched_get_priority_min(SCHED_FIFO) ||
+			    priority > sched_get_priority_max(SCHED_FIFO))
+				usage();
+			break;
+		case 'r':
+			ret = parse_recv_size(strdup(optarg));
+			if (ret < 0)
+				usage();
+			break;
 		case 's':
 			host_address = strtok(strdup(optarg), ":");
 			token = strtok(NULL, "");
 			if (token)
 				host_port = atoi(token);
 			break;
+		case 't':
+			peripheral_ingress_threads = true;
+			break;
 		case 'u':
 			uartdev = strtok(strdup(optarg), "@");
 			token = strtok(NULL, "");
@@ -163,6 +398,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	diag_pool_init(arena_size);
+	diag_rt_init(lock_memory, cpus, priority);
+
+	diag_stats_init();
+
 	if (host_address) {
 		ret = diag_sock_connect(host_address, host_port);
 		if (ret < 0)
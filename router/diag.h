@@ -67,7 +67,29 @@
 
 #define NHDLC_CONTROL_CHAR		0x7E
 
+/*
+ * Room reserved around messages received from peripherals, enough for a
+ * response code and a non-HDLC frame header in front and the frame's
+ * trailing control character behind.
+ */
+#define DIAG_HEADROOM			8
+#define DIAG_TAILROOM			1
+
 struct diag_client;
+struct ingress;
+struct mbuf;
+
+/**
+ * struct peripheral_budget - work done per data channel callback
+ * @packets:	messages dispatched before yielding to the event loop
+ * @bytes:	bytes dispatched before yielding to the event loop
+ *
+ * A value of 0 means no limit.
+ */
+struct peripheral_budget {
+	unsigned int packets;
+	size_t bytes;
+};
 
 struct peripheral {
 	struct list_head  node;
@@ -88,6 +110,8 @@ struct peripheral {
 	int dci_cmd_fd;
 
 	struct watch_flow *flow;
+	struct peripheral_budget budget;
+	struct ingress *ingress;
 
 	int diag_id;
 
@@ -120,6 +144,9 @@ struct diag_pkt_frame {
 } __packed;
 
 void queue_push(struct list_head *queue, const void *msg, size_t msglen);
+void queue_push_mbuf(struct list_head *queue, struct mbuf *mbuf,
+		     struct watch_flow *flow);
+struct mbuf *raw_encode_mbuf(const void *msg, size_t msglen);
 void queue_push_flow(struct list_head *queue, const void *msg, size_t msglen,
 		     struct watch_flow *flow);
 
@@ -137,6 +164,13 @@ int hdlc_enqueue_flow(struct list_head *queue, const void *buf, size_t msglen,
 		 struct watch_flow *flow);
 void queue_push_nhdlc_flow(struct list_head *queue, const void *msg, size_t msglen,
 			struct watch_flow *flow);
+struct mbuf *hdlc_encode_mbuf(const void *msg, size_t msglen);
+struct mbuf *hdlc_frame_mbuf(struct mbuf *mbuf);
+struct mbuf *hdlc_batch_encode_mbuf(const void *msg, size_t msglen);
+struct mbuf *hdlc_batch_frame_mbuf(struct mbuf *mbuf);
+struct mbuf *nhdlc_encode_mbuf(const void *msg, size_t msglen);
+struct mbuf *nhdlc_frame_mbuf(struct mbuf *mbuf);
+struct mbuf *diag_mbuf_alloc(size_t len);
 
 void register_fallback_cmd(unsigned int cmd,
 			   int(*cb)(struct diag_client *client,
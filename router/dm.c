@@ -32,14 +32,57 @@
 
 #include <err.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "diag.h"
 #include "dm.h"
+#include "mbuf.h"
 #include "watch.h"
 
+/* Default flow control watermarks of a DM's outgoing queue */
+#define DM_FLOW_PACKETS_HIGH	256
+#define DM_FLOW_PACKETS_LOW	128
+#define DM_FLOW_BYTES_HIGH	(256 * 1024)
+#define DM_FLOW_BYTES_LOW	(128 * 1024)
+
+/* Default receive buffer size, commands from the host are small */
+#define DM_RECV_BUF_SIZE	4096
+
+/* Default memory budgets of all and of each DM's outgoing queue */
+#define DM_BUDGET_TOTAL		(4 * 1024 * 1024)
+#define DM_BUDGET_CLIENT	(1024 * 1024)
+
+/* Queued messages dropped at most to serve an allocation */
+#define DM_RECLAIM_MAX		4
+
+/*
+ * Messages are classified for dropping, the lowest class is dropped first.
+ * Command responses are dropped last, as the DM is waiting for them.
+ */
+enum dm_class {
+	DM_CLASS_LOG,
+	DM_CLASS_MSG,
+	DM_CLASS_EVENT,
+	DM_CLASS_RSP,
+	DM_CLASS_COUNT,
+};
+
+static const char * const dm_class_names[DM_CLASS_COUNT] = {
+	[DM_CLASS_LOG] = "log",
+	[DM_CLASS_MSG] = "msg",
+	[DM_CLASS_EVENT] = "event",
+	[DM_CLASS_RSP] = "rsp",
+};
+
+#define DIAG_CMD_LOG			0x10
+#define DIAG_CMD_EVENT			0x60
+#define DIAG_CMD_EXT_MSG		0x79
+#define DIAG_CMD_EXT_MSG_TERSE		0x92
+#define DIAG_CMD_QSR4_EXT_MSG		0x99
+
 /**
  * DOC: Diagnostic Monitor
  */
@@ -51,19 +94,48 @@ struct diag_client {
 	int out_fd;
 
 	int encode_type;
-	bool encode_hdlc_reset;
+	struct watch_timer *hdlc_reset_timer;
 
 	bool enabled;
 
 	struct circ_buf recv_buf;
 	struct hdlc_decoder recv_decoder;
+	unsigned long recv_bad_frames;
 
 	struct list_head outq;
+	struct watch_flow *flow;
+
+	unsigned long dropped[DM_CLASS_COUNT];
+	unsigned long dropped_bytes;
+
 	struct list_head node;
 };
 
 struct list_head diag_clients = LIST_INIT(diag_clients);
 
+static size_t dm_budget_total = DM_BUDGET_TOTAL;
+static size_t dm_budget_client = DM_BUDGET_CLIENT;
+static enum dm_drop_policy dm_drop_policy = DM_DROP_NEWEST;
+
+static unsigned long dm_dropped;
+static unsigned long dm_dropped_bytes;
+
+static const struct watch_flow_limits dm_default_flow_limits = {
+	.packets_high = DM_FLOW_PACKETS_HIGH,
+	.packets_low = DM_FLOW_PACKETS_LOW,
+	.bytes_high = DM_FLOW_BYTES_HIGH,
+	.bytes_low = DM_FLOW_BYTES_LOW,
+};
+
+/*
+ * Budgeted DM queues are bounded by dropping messages, rather than by holding
+ * off the peripherals for every DM
+ */
+static bool dm_budgeted(void)
+{
+	return dm_budget_total || dm_budget_client;
+}
+
 /**
  * dm_add() - register new DM
  * @dm:		DM object to register
@@ -82,9 +154,20 @@ struct diag_client *dm_add(const char *name, int in_fd, int out_fd, bool is_enco
 	dm->encode_type = (is_encoded) ? DIAG_ENCODE_HDLC : DIAG_ENCODE_RAW;
 	list_init(&dm->outq);
 
+	circ_init(&dm->recv_buf, name, DM_RECV_BUF_SIZE);
+
+	dm->flow = watch_flow_new();
+	if (!dm->flow)
+		err(1, "failed to allocate DM flow control context");
+
+	dm_set_flow_limits(dm, &dm_default_flow_limits);
+	watch_flow_set_isolated(dm->flow, dm_budgeted());
+
 	if (dm->in_fd >= 0)
 		watch_add_readfd(dm->in_fd, dm_recv, dm, NULL);
-	watch_add_writeq(dm->out_fd, &dm->outq);
+	watch_add_writeq(dm->out_fd, &dm->outq, dm->flow);
+	watch_set_name(dm->in_fd, dm->name);
+	watch_set_name(dm->out_fd, dm->name);
 
 	list_add(&diag_clients, &dm->node);
 
@@ -94,14 +177,63 @@ struct diag_client *dm_add(const char *name, int in_fd, int out_fd, bool is_enco
 	return dm;
 }
 
+static void dm_release_buffers(struct diag_client *dm)
+{
+	circ_release(&dm->recv_buf);
+	hdlc_decoder_release(&dm->recv_decoder);
+}
+
+/* Remove a message not yet written from the DM's outgoing queue */
+static size_t dm_dequeue(struct diag_client *dm, struct mbuf *mbuf)
+{
+	size_t len = mbuf_len(mbuf);
+
+	list_del(&mbuf->node);
+	watch_flow_dec(mbuf->flow, len);
+	watch_flow_dec(dm->flow, len);
+	mbuf_free(mbuf);
+
+	return len;
+}
+
+/*
+ * Unregister a DM whose remote end went away, dropping the messages still
+ * queued to it, so that its queue doesn't hold memory or block peripherals
+ */
+static void dm_remove(struct diag_client *dm)
+{
+	struct mbuf *mbuf;
+
+	while (!list_empty(&dm->outq)) {
+		mbuf = list_entry_first(&dm->outq, struct mbuf, node);
+		dm_dequeue(dm, mbuf);
+	}
+
+	if (dm->in_fd >= 0)
+		watch_remove_fd(dm->in_fd);
+	watch_remove_fd(dm->out_fd);
+	watch_flow_free(dm->flow);
+
+	if (dm->hdlc_reset_timer)
+		watch_cancel_timer(dm->hdlc_reset_timer);
+
+	if (dm->in_fd >= 0 && dm->in_fd != dm->out_fd)
+		close(dm->in_fd);
+	close(dm->out_fd);
+
+	list_del(&dm->node);
+	dm_release_buffers(dm);
+	free((void *)dm->name);
+	free(dm);
+}
+
 static int dm_recv_hdlc(struct diag_client *dm, struct circ_buf *buf)
 {
-	struct hdlc_decoder recv_decoder = {0};
 	size_t msglen;
 	void *msg;
 
-	for (;;) {
-		msg = hdlc_decode_one(&recv_decoder, buf, &msglen);
+	while (dm->encode_type == DIAG_ENCODE_HDLC) {
+		msg = hdlc_decode_one(&dm->recv_decoder, buf, &msglen);
 		if (!msg)
 			break;
 
@@ -120,13 +252,14 @@ static int dm_recv_raw(struct diag_client *dm)
 	for (;;) {
 		n = read(dm->in_fd, buf, sizeof(buf));
 		if (!n) {
-			watch_remove_fd(dm->in_fd);
+			dm_remove(dm);
 			break;
 		} else if (n < 0 && errno == EAGAIN) {
 			break;
 		} else if (n < 0) {
 			saved_errno = -errno;
 			warn("Failed to read from %s\n", dm->name);
+			dm_remove(dm);
 			return saved_errno;
 		}
 
@@ -141,7 +274,7 @@ static void diag_hdlc_reset(void *data)
 	struct diag_client *dm = (struct diag_client *)data;
 
 	set_encode_type(DIAG_ENCODE_HDLC);
-	dm->encode_hdlc_reset = false;
+	dm->hdlc_reset_timer = NULL;
 }
 
 #define DIAG_MAX_BAD_CMD	5
@@ -149,10 +282,9 @@ static int diag_start_hdlc_recovery(struct diag_client *dm)
 {
 	static uint32_t bad_cmd_counter;
 
-	if (!dm->encode_hdlc_reset) {
-		watch_add_timer(diag_hdlc_reset, (void *)dm, 200, 0);
-		dm->encode_hdlc_reset = true;
-	}
+	if (!dm->hdlc_reset_timer)
+		dm->hdlc_reset_timer = watch_add_timer(diag_hdlc_reset,
+						       (void *)dm, 200, 0);
 
 	bad_cmd_counter++;
 	if (bad_cmd_counter > DIAG_MAX_BAD_CMD) {
@@ -163,57 +295,164 @@ static int diag_start_hdlc_recovery(struct diag_client *dm)
 	return 0;
 }
 
-static int dm_check_nhdlc_pkt(struct diag_client *dm, struct diag_pkt_frame *pkt_ptr)
+/**
+ * dm_check_nhdlc_pkt() - validate the non-HDLC frame at the start of the ring
+ * @dm:		DM the frame was received from
+ * @buf:	receive buffer, holding at least one byte
+ *
+ * Return: length of the frame, 0 if it is not complete yet, negative errno
+ * if the data does not start with a valid frame
+ */
+static ssize_t dm_check_nhdlc_pkt(struct diag_client *dm, struct circ_buf *buf)
 {
-	if (pkt_ptr->start != NHDLC_CONTROL_CHAR ||
-		 *(uint8_t *)(pkt_ptr->data + pkt_ptr->length) != NHDLC_CONTROL_CHAR) {
-		warn("Diag: pkt is not correct, %s\n", dm->name);
-		return -EINVAL;
-	}
+	const struct diag_pkt_frame *pkt_ptr;
+	size_t cnt = CIRC_CNT(buf);
+	size_t len;
 
-	return 0;
+	pkt_ptr = (const struct diag_pkt_frame *)CIRC_DATA(buf);
+	if (pkt_ptr->start != NHDLC_CONTROL_CHAR)
+		goto err;
+
+	if (cnt < sizeof(*pkt_ptr))
+		return 0;
+
+	len = sizeof(*pkt_ptr) + pkt_ptr->length + sizeof(uint8_t);
+
+	/* A frame larger than the ring would never complete */
+	if (len >= buf->size)
+		goto err;
+
+	if (cnt < len)
+		return 0;
+
+	if (pkt_ptr->data[pkt_ptr->length] != NHDLC_CONTROL_CHAR)
+		goto err;
+
+	return len;
+
+err:
+	warnx("Diag: pkt is not correct, %s\n", dm->name);
+	return -EINVAL;
+}
+
+/* Drop the start of a bad frame and anything up to the next start byte */
+static void dm_nhdlc_resync(struct circ_buf *buf)
+{
+	const char *ptr = CIRC_DATA(buf);
+	size_t cnt = CIRC_CNT(buf);
+	const char *next;
+
+	next = memchr(ptr + 1, NHDLC_CONTROL_CHAR, cnt - 1);
+	circ_consume(buf, next ? (size_t)(next - ptr) : cnt);
 }
 
+/*
+ * Frames are handled in place in the ring, which maps its pages twice so that
+ * a frame wrapping around the end is still contiguous. An incomplete frame is
+ * left in the ring until the rest of it is read.
+ */
 static int dm_recv_nhdlc(struct diag_client *dm, struct circ_buf *buf)
 {
 	struct diag_pkt_frame *pkt_ptr;
-	int ret;
+	ssize_t len;
+	int ret = 0;
+
+	while (dm->encode_type == DIAG_ENCODE_NHDLC && CIRC_CNT(buf)) {
+		len = dm_check_nhdlc_pkt(dm, buf);
+		if (!len)
+			break;
+
+		if (len < 0) {
+			dm->recv_bad_frames++;
+			diag_start_hdlc_recovery(dm);
+			dm_nhdlc_resync(buf);
+			ret = len;
+			continue;
+		}
 
-	pkt_ptr = (struct diag_pkt_frame *)buf;
-	ret = dm_check_nhdlc_pkt(dm, pkt_ptr);
-	if (ret)
-		diag_start_hdlc_recovery(dm);
-	diag_client_handle_command(dm, &pkt_ptr->data[0], pkt_ptr->length);
+		pkt_ptr = (struct diag_pkt_frame *)CIRC_DATA(buf);
+		diag_client_handle_command(dm, pkt_ptr->data, pkt_ptr->length);
+
+		circ_consume(buf, len);
+	}
 
 	return ret;
 }
 
 int dm_decode_data(struct diag_client *dm, struct circ_buf *buf)
 {
-	switch (dm->encode_type) {
-	case DIAG_ENCODE_HDLC:
-		return dm_recv_hdlc(dm, buf);
-	case DIAG_ENCODE_NHDLC:
-		return dm_recv_nhdlc(dm, buf);
-	default:
-		warn("Diag: recv error encode type %d\n", dm->encode_type);
-		return -EINVAL;
-	}
+	int type;
+	int ret;
+
+	/* A command may switch the encoding, the rest is decoded accordingly */
+	do {
+		type = dm->encode_type;
+		switch (type) {
+		case DIAG_ENCODE_HDLC:
+			ret = dm_recv_hdlc(dm, buf);
+			break;
+		case DIAG_ENCODE_NHDLC:
+			ret = dm_recv_nhdlc(dm, buf);
+			break;
+		default:
+			warn("Diag: recv error encode type %d\n", type);
+			return -EINVAL;
+		}
+	} while (dm->encode_type != type && CIRC_CNT(buf));
+
+	return ret;
 }
 
 static int dm_recv_encoded(struct diag_client *dm)
 {
+	int saved_errno;
 	ssize_t n;
 
 	n = circ_read(dm->in_fd, &dm->recv_buf);
-	if (n < 0 && errno != EAGAIN) {
+	if (n < 0 && errno == EPIPE) {
+		/* Handle what was received before the remote end went away */
+		dm_decode_data(dm, &dm->recv_buf);
+		dm_remove(dm);
+		return 0;
+	} else if (n < 0 && errno != EAGAIN) {
+		saved_errno = -errno;
 		warn("Failed to read from %s\n", dm->name);
-		return -errno;
+		dm_remove(dm);
+		return saved_errno;
 	}
 
 	return dm_decode_data(dm, &dm->recv_buf);
 }
 
+/**
+ * dm_recv_data() - handle data from a DM received by the caller
+ * @dm:		the DM the data was received from
+ * @ptr:	the received data
+ * @len:	length of @ptr
+ *
+ * The data is appended to the DM's receive buffer, so that frames may span
+ * multiple calls.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int dm_recv_data(struct diag_client *dm, const void *ptr, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = circ_write(&dm->recv_buf, ptr, len);
+		if (!n)
+			return -ENOBUFS;
+
+		dm_decode_data(dm, &dm->recv_buf);
+
+		ptr = (const char *)ptr + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
 /**
  * dm_recv() - read and handle data from a DM
  * @fd:		the file descriptor associated with the DM
@@ -240,28 +479,234 @@ int dm_recv(int fd, void* data)
 	return -EINVAL;
 }
 
-static int dm_send_flow(struct diag_client *dm, const void *ptr, size_t len,
-			    struct watch_flow *flow)
+/**
+ * dm_set_flow_limits() - configure flow control of the DM's outgoing queue
+ * @dm:		DM object
+ * @limits:	watermarks of the outgoing queue
+ *
+ * While the outgoing queue of a DM is above its watermarks no further data
+ * is read from the peripherals, unless the queues are budgeted, see
+ * dm_set_budget().
+ */
+void dm_set_flow_limits(struct diag_client *dm,
+			const struct watch_flow_limits *limits)
 {
-	if (dm && !dm->enabled)
-		return 0;
+	watch_flow_set_limits(dm->flow, limits);
+}
 
-	switch (dm->encode_type) {
+/* Encode a message for a DM of the given encoding type */
+static struct mbuf *dm_encode(int encode_type, const void *ptr, size_t len)
+{
+	switch (encode_type) {
 	case DIAG_ENCODE_RAW:
-		queue_push_flow(&dm->outq, ptr, len, flow);
-		break;
+		return raw_encode_mbuf(ptr, len);
 	case DIAG_ENCODE_HDLC:
-		hdlc_enqueue_flow(&dm->outq, ptr, len, flow);
-		break;
+		return hdlc_encode_mbuf(ptr, len);
 	case DIAG_ENCODE_NHDLC:
-		queue_push_nhdlc_flow(&dm->outq, ptr, len, flow);
-		break;
+		return nhdlc_encode_mbuf(ptr, len);
 	default:
-		warn("Diag: send error encode type %d\n", dm->encode_type);
-		return -EINVAL;
+		warnx("Diag: send error encode type %d\n", encode_type);
+		return NULL;
 	}
+}
 
-	return 0;
+/*
+ * Encode the message of a mbuf for a DM of the given encoding type, sharing
+ * the payload of @mbuf where the encoding allows
+ */
+static struct mbuf *dm_encode_mbuf(int encode_type, struct mbuf *mbuf)
+{
+	switch (encode_type) {
+	case DIAG_ENCODE_RAW:
+		return mbuf_clone(mbuf);
+	case DIAG_ENCODE_HDLC:
+		return hdlc_frame_mbuf(mbuf);
+	case DIAG_ENCODE_NHDLC:
+		return nhdlc_frame_mbuf(mbuf);
+	default:
+		warnx("Diag: send error encode type %d\n", encode_type);
+		return NULL;
+	}
+}
+
+/* Class of a message for dropping, from its command code */
+static enum dm_class dm_classify(const void *ptr, size_t len)
+{
+	if (!len)
+		return DM_CLASS_RSP;
+
+	switch (*(const uint8_t *)ptr) {
+	case DIAG_CMD_LOG:
+		return DM_CLASS_LOG;
+	case DIAG_CMD_EXT_MSG:
+	case DIAG_CMD_EXT_MSG_TERSE:
+	case DIAG_CMD_QSR4_EXT_MSG:
+		return DM_CLASS_MSG;
+	case DIAG_CMD_EVENT:
+		return DM_CLASS_EVENT;
+	default:
+		return DM_CLASS_RSP;
+	}
+}
+
+static enum dm_class dm_classify_mbuf(struct mbuf *mbuf)
+{
+	uint8_t cmd;
+
+	if (mbuf_copydata(mbuf, 0, sizeof(cmd), &cmd) < 0)
+		return DM_CLASS_RSP;
+
+	return dm_classify(&cmd, sizeof(cmd));
+}
+
+static void dm_account_drop(struct diag_client *dm, unsigned int class,
+			    size_t len)
+{
+	dm->dropped[class]++;
+	dm->dropped_bytes += len;
+	dm_dropped++;
+	dm_dropped_bytes += len;
+}
+
+/*
+ * Find the DM whose queue has to shrink for @len more bytes to be queued to
+ * @dm; @dm itself when over its own budget, otherwise the largest queue when
+ * over the total budget. A budget of 0 is unlimited.
+ */
+static struct diag_client *dm_over_budget(struct diag_client *dm, size_t len)
+{
+	struct diag_client *largest = dm;
+	struct diag_client *it;
+	size_t total = len;
+	size_t bytes;
+
+	if (dm_budget_client && watch_flow_bytes(dm->flow) + len > dm_budget_client)
+		return dm;
+
+	if (!dm_budget_total)
+		return NULL;
+
+	list_for_each_entry(it, &diag_clients, node) {
+		bytes = watch_flow_bytes(it->flow);
+		if (bytes > watch_flow_bytes(largest->flow))
+			largest = it;
+		total += bytes;
+	}
+
+	return total > dm_budget_total ? largest : NULL;
+}
+
+/*
+ * Pick a queued message of @dm to drop in favour of a new message of
+ * @class, according to the drop policy. Messages already being written are
+ * no longer in the queue and can't be dropped.
+ */
+static struct mbuf *dm_drop_victim(struct diag_client *dm, unsigned int class)
+{
+	struct mbuf *victim = NULL;
+	struct mbuf *mbuf;
+
+	if (list_empty(&dm->outq))
+		return NULL;
+
+	switch (dm_drop_policy) {
+	case DM_DROP_NEWEST:
+		break;
+	case DM_DROP_OLDEST:
+		victim = list_entry_first(&dm->outq, struct mbuf, node);
+		break;
+	case DM_DROP_CLASS:
+		list_for_each_entry(mbuf, &dm->outq, node) {
+			if (mbuf->priority > class)
+				continue;
+
+			if (!victim || mbuf->priority < victim->priority)
+				victim = mbuf;
+		}
+		break;
+	}
+
+	return victim;
+}
+
+/*
+ * Drop queued messages until @len bytes of @class fit the budgets.
+ *
+ * Return: true if the message can be queued, false if it should be dropped
+ */
+static bool dm_make_room(struct diag_client *dm, size_t len, unsigned int class)
+{
+	struct diag_client *owner;
+	struct mbuf *victim;
+	unsigned int prio;
+
+	while ((owner = dm_over_budget(dm, len)) != NULL) {
+		victim = dm_drop_victim(owner, class);
+		if (!victim)
+			return false;
+
+		prio = victim->priority;
+		dm_account_drop(owner, prio, dm_dequeue(owner, victim));
+	}
+
+	return true;
+}
+
+/*
+ * Return memory to the mbuf pools, when they can't grow, by dropping a
+ * queued message from the largest DM queue according to the drop policy.
+ * As the memory freed might not suit the allocation, @tries bounds the number
+ * of messages dropped in favour of one.
+ *
+ * Return: true if a message was dropped, false if there's none to drop
+ */
+static bool dm_reclaim(unsigned int class, unsigned int *tries)
+{
+	struct diag_client *owner = NULL;
+	struct mbuf *victim = NULL;
+	struct diag_client *dm;
+	struct mbuf *mbuf;
+	unsigned int prio;
+
+	if ((*tries)++ == DM_RECLAIM_MAX)
+		return false;
+
+	list_for_each_entry(dm, &diag_clients, node) {
+		mbuf = dm_drop_victim(dm, class);
+		if (!mbuf)
+			continue;
+
+		if (!owner ||
+		    watch_flow_bytes(dm->flow) > watch_flow_bytes(owner->flow)) {
+			owner = dm;
+			victim = mbuf;
+		}
+	}
+
+	if (!victim)
+		return false;
+
+	prio = victim->priority;
+	dm_account_drop(owner, prio, dm_dequeue(owner, victim));
+
+	return true;
+}
+
+/* Queue an encoded message, accounted against the DM's flow and @flow */
+static void dm_queue(struct diag_client *dm, struct mbuf *mbuf,
+		     struct watch_flow *flow, enum dm_class class)
+{
+	size_t len = mbuf_len(mbuf);
+
+	if (!dm_make_room(dm, len, class)) {
+		dm_account_drop(dm, class, len);
+		mbuf_free(mbuf);
+		return;
+	}
+
+	mbuf->priority = class;
+	queue_push_mbuf(&dm->outq, mbuf, flow);
+	watch_flow_inc(dm->flow, len);
 }
 
 /**
@@ -272,7 +717,144 @@ static int dm_send_flow(struct diag_client *dm, const void *ptr, size_t len,
  */
 int dm_send(struct diag_client *dm, const void *ptr, size_t len)
 {
-	return dm_send_flow(dm, ptr, len, NULL);
+	unsigned int tries = 0;
+	enum dm_class class;
+	struct mbuf *mbuf;
+
+	if (!dm->enabled)
+		return 0;
+
+	class = dm_classify(ptr, len);
+
+	do {
+		mbuf = dm_encode(dm->encode_type, ptr, len);
+	} while (!mbuf && dm_reclaim(class, &tries));
+
+	if (!mbuf) {
+		dm_account_drop(dm, class, len);
+		return -ENOMEM;
+	}
+
+	dm_queue(dm, mbuf, NULL, class);
+
+	return 0;
+}
+
+/**
+ * dm_send_mbuf() - enqueue message held in a mbuf to DM
+ * @dm:		dm to be receiving the message
+ * @mbuf:	mbuf holding the raw message, consumed
+ *
+ * Non-HDLC framing is done in place if @mbuf has DIAG_HEADROOM and
+ * DIAG_TAILROOM, and raw messages are queued without copying.
+ */
+int dm_send_mbuf(struct diag_client *dm, struct mbuf *mbuf)
+{
+	struct mbuf *encoded = NULL;
+	unsigned int tries = 0;
+	enum dm_class class;
+
+	if (!dm->enabled) {
+		mbuf_free(mbuf);
+		return 0;
+	}
+
+	class = dm_classify_mbuf(mbuf);
+
+	do {
+		encoded = dm_encode_mbuf(dm->encode_type, mbuf);
+	} while (!encoded && dm_reclaim(class, &tries));
+
+	if (!encoded)
+		dm_account_drop(dm, class, mbuf_len(mbuf));
+
+	mbuf_free(mbuf);
+
+	if (!encoded)
+		return -ENOMEM;
+
+	dm_queue(dm, encoded, NULL, class);
+
+	return 0;
+}
+
+/*
+ * Encode the message for a type of DM. HDLC frames are packed into the
+ * broadcast batch, raw and non-HDLC encodings are made from *@mbuf, which is
+ * allocated with room for framing on first use unless provided by the caller.
+ */
+static struct mbuf *dm_broadcast_encode_type(int type, struct mbuf **mbuf,
+					     const void *ptr, size_t len)
+{
+	if (type == DIAG_ENCODE_HDLC)
+		return *mbuf ? hdlc_batch_frame_mbuf(*mbuf) :
+			       hdlc_batch_encode_mbuf(ptr, len);
+
+	if (!*mbuf) {
+		*mbuf = diag_mbuf_alloc(len);
+		if (!*mbuf)
+			return NULL;
+
+		memcpy(mbuf_put(*mbuf, len), ptr, len);
+	}
+
+	return dm_encode_mbuf(type, *mbuf);
+}
+
+/*
+ * Encode the message once per encoding type in use and share the resulting
+ * payload between the DMs using it. Should the mbuf pools run out, queued
+ * messages are dropped to make room according to the drop policy, or else
+ * the message is dropped.
+ */
+static void dm_broadcast_encode(struct mbuf *mbuf, const void *ptr, size_t len,
+				struct watch_flow *flow)
+{
+	struct mbuf *encoded[DIAG_ENCODE_NHDLC + 1] = {};
+	struct diag_client *dm;
+	enum dm_class class;
+	unsigned int tries;
+	struct mbuf *msg;
+	int type;
+
+	class = mbuf ? dm_classify_mbuf(mbuf) : dm_classify(ptr, len);
+
+	list_for_each_entry(dm, &diag_clients, node) {
+		if (!dm->enabled)
+			continue;
+
+		type = dm->encode_type;
+		if (type < DIAG_ENCODE_RAW || type > DIAG_ENCODE_NHDLC) {
+			warnx("Diag: send error encode type %d\n", type);
+			continue;
+		}
+
+		tries = 0;
+
+		/*
+		 * Each DM is queued its own clone, as queued messages may be
+		 * dropped, while the encoded message is kept for the next DM.
+		 */
+		do {
+			if (!encoded[type])
+				encoded[type] = dm_broadcast_encode_type(type, &mbuf,
+									 ptr, len);
+
+			msg = encoded[type] ? mbuf_clone(encoded[type]) : NULL;
+		} while (!msg && dm_reclaim(class, &tries));
+
+		if (!msg) {
+			dm_account_drop(dm, class, mbuf ? mbuf_len(mbuf) : len);
+			continue;
+		}
+
+		dm_queue(dm, msg, flow, class);
+	}
+
+	for (type = DIAG_ENCODE_RAW; type <= DIAG_ENCODE_NHDLC; type++)
+		mbuf_free(encoded[type]);
+
+	mbuf_free(mbuf);
 }
 
 /**
@@ -280,17 +862,26 @@ int dm_send(struct diag_client *dm, const void *ptr, size_t len)
  * @ptr:	pointer to raw message to be sent
  * @len:	length of message
  * @flow:	flow control context for the peripheral
+ *
+ * The message is encoded once per encoding type in use, DMs using the same
+ * encoding share the resulting payload.
  */
 void dm_broadcast(const void *ptr, size_t len, struct watch_flow *flow)
 {
-	struct diag_client *dm;
-	struct list_head *item;
-
-	list_for_each(item, &diag_clients) {
-		dm = container_of(item, struct diag_client, node);
+	dm_broadcast_encode(NULL, ptr, len, flow);
+}
 
-		dm_send_flow(dm, ptr, len, flow);
-	}
+/**
+ * dm_broadcast_mbuf() - send message held in a mbuf to all registered DMs
+ * @mbuf:	mbuf holding the raw message, consumed
+ * @flow:	flow control context for the peripheral
+ *
+ * As dm_broadcast(), but raw DMs share the payload of @mbuf and non-HDLC
+ * framing is done in place, given DIAG_HEADROOM and DIAG_TAILROOM.
+ */
+void dm_broadcast_mbuf(struct mbuf *mbuf, struct watch_flow *flow)
+{
+	dm_broadcast_encode(mbuf, NULL, 0, flow);
 }
 
 void dm_enable(struct diag_client *dm)
@@ -300,9 +891,93 @@ void dm_enable(struct diag_client *dm)
 
 void dm_disable(struct diag_client *dm)
 {
+	struct mbuf *mbuf;
+
 	dm->enabled = false;
 
-	/* XXX: purge dm->outq */
+	while (!list_empty(&dm->outq)) {
+		mbuf = list_entry_first(&dm->outq, struct mbuf, node);
+		dm_dequeue(dm, mbuf);
+	}
+
+	dm_release_buffers(dm);
+}
+
+/**
+ * dm_set_recv_size() - size the receive buffer of a DM to its transfers
+ * @dm:		DM object
+ * @size:	largest amount of data received at once
+ *
+ * Buffers are otherwise sized for commands, a size configured for the DM by
+ * name still takes precedence.
+ */
+void dm_set_recv_size(struct diag_client *dm, size_t size)
+{
+	circ_release(&dm->recv_buf);
+	circ_init(&dm->recv_buf, dm->name, size);
+}
+
+/**
+ * dm_set_budget() - configure the memory budget of the DM outgoing queues
+ * @total:	bytes queued to all DMs, 0 for no limit
+ * @client:	bytes queued to each DM, 0 for no limit
+ * @policy:	which messages to drop when a budget is exceeded
+ *
+ * The budgets cover messages queued and being written, they bound memory use
+ * should a DM stop reading. A message shared between DMs is accounted once
+ * per DM. While budgeted, a DM's queue backing up drops messages to it rather
+ * than holding off the peripherals; without budgets the flow control
+ * watermarks of the DMs apply.
+ */
+void dm_set_budget(size_t total, size_t client, enum dm_drop_policy policy)
+{
+	struct diag_client *dm;
+
+	dm_budget_total = total;
+	dm_budget_client = client;
+	dm_drop_policy = policy;
+
+	list_for_each_entry(dm, &diag_clients, node)
+		watch_flow_set_isolated(dm->flow, dm_budgeted());
+}
+
+/**
+ * dm_dump_stats() - print DM queue usage and drop counters
+ * @fp:		stream to print to
+ */
+void dm_dump_stats(FILE *fp)
+{
+	static const char * const policies[] = {
+		[DM_DROP_NEWEST] = "newest",
+		[DM_DROP_OLDEST] = "oldest",
+		[DM_DROP_CLASS] = "class",
+	};
+	unsigned long crc_errors;
+	unsigned long oversize;
+	struct diag_client *dm;
+	size_t total = 0;
+	int i;
+
+	list_for_each_entry(dm, &diag_clients, node)
+		total += watch_flow_bytes(dm->flow);
+
+	fprintf(fp, "DM queues: %zu of %zu bytes, drop %s, dropped %lu (%lu bytes)\n",
+		total, dm_budget_total, policies[dm_drop_policy],
+		dm_dropped, dm_dropped_bytes);
+
+	list_for_each_entry(dm, &diag_clients, node) {
+		fprintf(fp, "  %s: %zu of %zu bytes, dropped",
+			dm->name, watch_flow_bytes(dm->flow), dm_budget_client);
+		for (i = 0; i < DM_CLASS_COUNT; i++)
+			fprintf(fp, " %s %lu", dm_class_names[i], dm->dropped[i]);
+		fprintf(fp, " (%lu bytes)\n", dm->dropped_bytes);
+
+		crc_errors = 0;
+		oversize = 0;
+		hdlc_decoder_stats(&dm->recv_decoder, &crc_errors, &oversize);
+		fprintf(fp, "    received dropped bad crc %lu oversize %lu bad frame %lu\n",
+			crc_errors, oversize, dm->recv_bad_frames);
+	}
 }
 
 void set_encode_type(int type)
@@ -40,14 +40,36 @@ enum diag_encode_type {
 	DIAG_ENCODE_NHDLC,
 };
 
+/**
+ * enum dm_drop_policy - messages dropped when a DM memory budget is exceeded
+ * @DM_DROP_NEWEST:	drop the message being queued
+ * @DM_DROP_OLDEST:	drop the oldest queued messages
+ * @DM_DROP_CLASS:	drop queued messages of the least important class, but
+ *			not above that of the message being queued
+ */
+enum dm_drop_policy {
+	DM_DROP_NEWEST,
+	DM_DROP_OLDEST,
+	DM_DROP_CLASS,
+};
+
 struct diag_client;
+struct watch_flow_limits;
 
 struct diag_client *dm_add(const char *name, int in_fd, int out_fd, bool hdlc_encoded);
 int dm_recv(int fd, void* data);
+int dm_recv_data(struct diag_client *dm, const void *ptr, size_t len);
 int dm_send(struct diag_client *dm, const void *ptr, size_t len);
+int dm_send_mbuf(struct diag_client *dm, struct mbuf *mbuf);
 void dm_broadcast(const void *ptr, size_t len, struct watch_flow *flow);
+void dm_broadcast_mbuf(struct mbuf *mbuf, struct watch_flow *flow);
 void dm_enable(struct diag_client *dm);
 void dm_disable(struct diag_client *dm);
+void dm_set_flow_limits(struct diag_client *dm,
+			const struct watch_flow_limits *limits);
+void dm_set_recv_size(struct diag_client *dm, size_t size);
+void dm_set_budget(size_t total, size_t client, enum dm_drop_policy policy);
+void dm_dump_stats(FILE *fp);
 
 int dm_decode_data(struct diag_client *dm, struct circ_buf *buf);
 void set_encode_type(int type);
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "diag.h"
+#include "mbuf.h"
+#include "watch.h"
+
+/**
+ * queue_push_mbuf() - append a mbuf to a queue
+ * @queue:	the queue
+ * @mbuf:	the mbuf, ownership of which is passed to the queue
+ * @flow:	flow control context the mbuf is accounted against, may be NULL
+ */
+void queue_push_mbuf(struct list_head *queue, struct mbuf *mbuf,
+		     struct watch_flow *flow)
+{
+	mbuf->flow = flow;
+	mbuf_stamp(mbuf);
+
+	watch_flow_inc(flow, mbuf_len(mbuf));
+
+	list_add(queue, &mbuf->node);
+}
+
+/**
+ * nhdlc_encode_mbuf() - wrap a message in a non-HDLC frame
+ * @msg:	the message
+ * @msglen:	length of @msg
+ *
+ * Return: mbuf holding the frame, or NULL on failure
+ */
+struct mbuf *nhdlc_encode_mbuf(const void *msg, size_t msglen)
+{
+	size_t len;
+	size_t off = 0;
+	struct mbuf *mbuf = NULL;
+	uint8_t *ptr = NULL;
+
+	len = msglen + sizeof(struct diag_pkt_frame) + sizeof(uint8_t);
+
+	mbuf = mbuf_alloc(len);
+	if (!mbuf) {
+		warnx("Diag: %s: failed to allocate memory", __func__);
+		return NULL;
+	}
+
+	ptr = mbuf_put(mbuf, len);
+	if (!ptr) {
+		warnx("Diag: %s: invalid ptr, dropping pkt of len: %zu\n", __func__, len);
+		mbuf_free(mbuf);
+		return NULL;
+	}
+
+	struct diag_pkt_frame *header = (struct diag_pkt_frame *)ptr;
+
+	header->start = NHDLC_CONTROL_CHAR;
+	header->version = 1;
+	header->length = msglen;
+
+	off += sizeof(struct diag_pkt_frame);
+	/* copy the actual packet */
+	memcpy(ptr + off, msg, msglen);
+	off += msglen; 
+
+	((uint8_t *)ptr)[off] = NHDLC_CONTROL_CHAR;
+	off += sizeof(uint8_t);
+
+	mbuf->offset = off;
+
+	return mbuf;
+}
+
+/**
+ * nhdlc_frame_mbuf() - wrap the message of a mbuf in a non-HDLC frame
+ * @mbuf:	mbuf holding the message
+ *
+ * The frame header and trailer are written around the message, in the
+ * headroom of the first and the tailroom of the last fragment of @mbuf, and a
+ * clone spanning the frame is returned. Without enough room the message is
+ * copied into a new frame.
+ *
+ * Return: mbuf holding the frame, or NULL on failure
+ */
+struct mbuf *nhdlc_frame_mbuf(struct mbuf *mbuf)
+{
+	struct diag_pkt_frame *header;
+	size_t msglen = mbuf_len(mbuf);
+	struct mbuf *frame;
+	struct mbuf *last;
+	uint8_t *trailer;
+
+	for (last = mbuf; last->next; last = last->next)
+		;
+
+	if (mbuf_headroom(mbuf) < sizeof(*header) || mbuf_tailroom(last) < 1) {
+		if (!mbuf->next)
+			return nhdlc_encode_mbuf(mbuf->data, msglen);
+
+		last = diag_mbuf_alloc(msglen);
+		if (!last)
+			return NULL;
+
+		mbuf_copydata(mbuf, 0, msglen, mbuf_put(last, msglen));
+		frame = nhdlc_frame_mbuf(last);
+		mbuf_free(last);
+
+		return frame;
+	}
+
+	frame = mbuf_clone(mbuf);
+	if (!frame)
+		return NULL;
+
+	header = mbuf_push(frame, sizeof(*header));
+	header->start = NHDLC_CONTROL_CHAR;
+	header->version = 1;
+	header->length = msglen;
+
+	for (last = frame; last->next; last = last->next)
+		;
+
+	trailer = mbuf_put(last, sizeof(*trailer));
+	*trailer = NHDLC_CONTROL_CHAR;
+
+	return frame;
+}
+
+/**
+ * diag_mbuf_alloc() - allocate a mbuf for a message to be framed in place
+ * @len:	length of the message
+ *
+ * Return: empty mbuf with room for @len bytes, DIAG_HEADROOM in front and
+ * DIAG_TAILROOM behind, or NULL on allocation failure
+ */
+struct mbuf *diag_mbuf_alloc(size_t len)
+{
+	struct mbuf *mbuf;
+
+	mbuf = mbuf_alloc(DIAG_HEADROOM + len + DIAG_TAILROOM);
+	if (!mbuf)
+		return NULL;
+
+	mbuf_reserve(mbuf, DIAG_HEADROOM);
+
+	return mbuf;
+}
+
+void queue_push_nhdlc_flow(struct list_head *queue, const void *msg, size_t msglen,
+			struct watch_flow *flow)
+{
+	struct mbuf *mbuf;
+
+	mbuf = nhdlc_encode_mbuf(msg, msglen);
+	if (!mbuf)
+		return;
+
+	queue_push_mbuf(queue, mbuf, flow);
+}
+
+/**
+ * raw_encode_mbuf() - copy a message into a mbuf
+ * @msg:	the message
+ * @msglen:	length of @msg
+ *
+ * Return: mbuf holding the message, or NULL on allocation failure
+ */
+struct mbuf *raw_encode_mbuf(const void *msg, size_t msglen)
+{
+	struct mbuf *mbuf;
+	void *ptr;
+
+	mbuf = mbuf_alloc(msglen);
+	if (!mbuf)
+		return NULL;
+
+	ptr = mbuf_put(mbuf, msglen);
+	memcpy(ptr, msg, msglen);
+
+	return mbuf;
+}
+
+void queue_push_flow(struct list_head *queue, const void *msg, size_t msglen,
+		     struct watch_flow *flow)
+{
+	struct mbuf *mbuf;
+
+	mbuf = raw_encode_mbuf(msg, msglen);
+	if (!mbuf)
+		err(1, "failed to allocate message buffer");
+
+	queue_push_mbuf(queue, mbuf, flow);
+}
+
+void queue_push(struct list_head *queue, const void *msg, size_t msglen)
+{
+	queue_push_flow(queue, msg, msglen, NULL);
+}
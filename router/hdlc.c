@@ -28,9 +28,23 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HDLC_HAVE_AVX2 1
+#define HDLC_HAVE_CLMUL 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+#define HDLC_HAVE_PMULL 1
+#endif
+#endif
+
 #include "hdlc.h"
 #include "util.h"
 
@@ -40,7 +54,9 @@
  * XORed with 0xffff.
  *
  * Calculation is performed with a table lookup as described in
- * http://www.ross.net/crc/download/crc_v3.txt
+ * http://www.ross.net/crc/download/crc_v3.txt, extended to eight bytes per
+ * step with the tables of crc_slice[] and, where carry-less multiplication is
+ * available, by folding the message 64 bytes at a time.
  */
 static uint16_t crc_table[256] = {
 	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf, 0x8c48,
@@ -79,87 +95,819 @@ static uint16_t hdlc_crc_byte(uint16_t crc, uint8_t ch)
 	return (crc >> 8) ^ crc_table[(crc ^ ch) & 0xff];
 }
 
-void *hdlc_encode(const void *src, size_t slen, size_t *dlen)
+static uint16_t hdlc_crc_bytes(uint16_t crc, const uint8_t *s, size_t len)
+{
+	while (len--)
+		crc = hdlc_crc_byte(crc, *s++);
+
+	return crc;
+}
+
+/* crc_slice[k][i] is the CRC of byte i followed by k zero bytes */
+static uint16_t crc_slice[8][256];
+
+static void hdlc_crc_slice_init(void)
 {
-	const uint8_t *end = src + slen;
-	const uint8_t *s = src;
-	uint16_t crc = 0xffff;
-	uint8_t tmp[2];
-	uint8_t *dst;
-	uint8_t *d;
 	int i;
+	int k;
 
-	dst = malloc((slen + 2) * 2 + 1);
-	if (!dst)
-		return NULL;
+	for (i = 0; i < 256; i++) {
+		crc_slice[0][i] = crc_table[i];
+		for (k = 1; k < 8; k++)
+			crc_slice[k][i] = hdlc_crc_byte(crc_slice[k - 1][i], 0);
+	}
+}
+
+static uint16_t hdlc_crc_slice8(uint16_t crc, const uint8_t *s, size_t len)
+{
+	while (len >= 8) {
+		crc ^= s[0] | s[1] << 8;
+		crc = crc_slice[7][crc & 0xff] ^ crc_slice[6][crc >> 8] ^
+		      crc_slice[5][s[2]] ^ crc_slice[4][s[3]] ^
+		      crc_slice[3][s[4]] ^ crc_slice[2][s[5]] ^
+		      crc_slice[1][s[6]] ^ crc_slice[0][s[7]];
+		s += 8;
+		len -= 8;
+	}
+
+	return hdlc_crc_bytes(crc, s, len);
+}
+
+#if defined(HDLC_HAVE_CLMUL) || defined(HDLC_HAVE_PMULL)
+/*
+ * Folding keeps a 128 bit remainder of the message, congruent to it modulo
+ * the polynomial, by multiplying each 64 bit half with x^n mod P for the
+ * distance it's moved. The CRC of the remainder, as a 16 byte message, is the
+ * CRC of the folded data.
+ *
+ * In the bit reflected domain the carry-less product of two 64 bit operands
+ * is the polynomial product times x, so the constants are x^(d + 63) mod P for
+ * the low half and x^(d - 1) mod P for the high half, d being the distance in
+ * bits, bit reversed into 64 bits.
+ */
+static uint64_t crc_fold128[2];
+static uint64_t crc_fold512[2];
+
+static uint64_t hdlc_crc_xpow(unsigned int n)
+{
+	uint16_t r = 1;
+	uint64_t k = 0;
+	int i;
+
+	while (n--)
+		r = (r << 1) ^ (r & 0x8000 ? 0x1021 : 0);
+
+	for (i = 0; i < 16; i++) {
+		if (r & (1 << i))
+			k |= 1ULL << (63 - i);
+	}
+
+	return k;
+}
+
+static void hdlc_crc_fold_init(void)
+{
+	crc_fold128[0] = hdlc_crc_xpow(128 + 63);
+	crc_fold128[1] = hdlc_crc_xpow(128 - 1);
+	crc_fold512[0] = hdlc_crc_xpow(512 + 63);
+	crc_fold512[1] = hdlc_crc_xpow(512 - 1);
+}
+#endif
+
+#ifdef HDLC_HAVE_CLMUL
+__attribute__((target("pclmul,sse2")))
+static inline __m128i hdlc_fold_clmul(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			     _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t hdlc_crc_clmul(uint16_t crc, const uint8_t *s, size_t len)
+{
+	const __m128i *p = (const __m128i *)s;
+	__m128i k128;
+	__m128i k512;
+	__m128i x[4];
+	uint8_t rem[16];
+	int i;
+
+	if (len < 64)
+		return hdlc_crc_slice8(crc, s, len);
+
+	k128 = _mm_loadu_si128((const __m128i *)crc_fold128);
+	k512 = _mm_loadu_si128((const __m128i *)crc_fold512);
+
+	/* The running CRC is equivalent to XORing it into the first bytes */
+	for (i = 0; i < 4; i++)
+		x[i] = _mm_loadu_si128(p++);
+	x[0] = _mm_xor_si128(x[0], _mm_cvtsi32_si128(crc));
+	len -= 64;
+
+	for (; len >= 64; len -= 64) {
+		for (i = 0; i < 4; i++)
+			x[i] = _mm_xor_si128(hdlc_fold_clmul(x[i], k512),
+					     _mm_loadu_si128(p++));
+	}
+
+	for (i = 1; i < 4; i++)
+		x[0] = _mm_xor_si128(hdlc_fold_clmul(x[0], k128), x[i]);
+
+	for (; len >= 16; len -= 16)
+		x[0] = _mm_xor_si128(hdlc_fold_clmul(x[0], k128),
+				     _mm_loadu_si128(p++));
+
+	_mm_storeu_si128((__m128i *)rem, x[0]);
+	crc = hdlc_crc_slice8(0, rem, sizeof(rem));
+
+	return hdlc_crc_slice8(crc, (const uint8_t *)p, len);
+}
+#endif
+
+#ifdef HDLC_HAVE_PMULL
+static inline uint8x16_t hdlc_fold_pmull(uint8x16_t x, const uint64_t *k)
+{
+	uint64x2_t v = vreinterpretq_u64_u8(x);
+	poly128_t lo;
+	poly128_t hi;
+
+	lo = vmull_p64((poly64_t)vgetq_lane_u64(v, 0), (poly64_t)k[0]);
+	hi = vmull_p64((poly64_t)vgetq_lane_u64(v, 1), (poly64_t)k[1]);
+
+	return veorq_u8(vreinterpretq_u8_p128(lo), vreinterpretq_u8_p128(hi));
+}
+
+static uint16_t hdlc_crc_pmull(uint16_t crc, const uint8_t *s, size_t len)
+{
+	uint8x16_t x[4];
+	uint8_t rem[16];
+	int i;
+
+	if (len < 64)
+		return hdlc_crc_slice8(crc, s, len);
+
+	/* The running CRC is equivalent to XORing it into the first bytes */
+	for (i = 0; i < 4; i++, s += 16)
+		x[i] = vld1q_u8(s);
+	x[0] = veorq_u8(x[0], vreinterpretq_u8_u64(vsetq_lane_u64(crc,
+						vdupq_n_u64(0), 0)));
+	len -= 64;
+
+	for (; len >= 64; len -= 64) {
+		for (i = 0; i < 4; i++, s += 16)
+			x[i] = veorq_u8(hdlc_fold_pmull(x[i], crc_fold512),
+					vld1q_u8(s));
+	}
+
+	for (i = 1; i < 4; i++)
+		x[0] = veorq_u8(hdlc_fold_pmull(x[0], crc_fold128), x[i]);
+
+	for (; len >= 16; len -= 16, s += 16)
+		x[0] = veorq_u8(hdlc_fold_pmull(x[0], crc_fold128),
+				vld1q_u8(s));
+
+	vst1q_u8(rem, x[0]);
+	crc = hdlc_crc_slice8(0, rem, sizeof(rem));
+
+	return hdlc_crc_slice8(crc, s, len);
+}
+#endif
+
+/* Value of the CRC after a frame, including its frame check, without errors */
+#define HDLC_CRC_GOOD	0xf0b8
+
+static inline bool hdlc_special(uint8_t ch)
+{
+	return ch == 0x7d || ch == 0x7e;
+}
+
+/*
+ * Bytes needing escape, 0x7d and 0x7e, are searched for with the widest
+ * vector instructions supported by the CPU. hdlc_scan() returns the offset of
+ * the first such byte, or @len if there's none, and hdlc_count() the number
+ * of them.
+ */
+static size_t hdlc_scan_scalar(const uint8_t *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (hdlc_special(s[i]))
+			break;
+	}
+
+	return i;
+}
+
+static size_t hdlc_count_scalar(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		count += hdlc_special(s[i]);
+
+	return count;
+}
+
+#ifdef __SSE2__
+static inline unsigned int hdlc_mask_sse2(const uint8_t *s)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)s);
+	__m128i esc = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7d));
+	__m128i flag = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7e));
+
+	return _mm_movemask_epi8(_mm_or_si128(esc, flag));
+}
+
+static size_t hdlc_scan_sse2(const uint8_t *s, size_t len)
+{
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = hdlc_mask_sse2(s + i);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + hdlc_scan_scalar(s + i, len - i);
+}
+
+static size_t hdlc_count_sse2(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		count += __builtin_popcount(hdlc_mask_sse2(s + i));
+
+	return count + hdlc_count_scalar(s + i, len - i);
+}
+#endif
+
+#ifdef HDLC_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline unsigned int hdlc_mask_avx2(const uint8_t *s)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)s);
+	__m256i esc = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7d));
+	__m256i flag = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7e));
+
+	return _mm256_movemask_epi8(_mm256_or_si256(esc, flag));
+}
+
+__attribute__((target("avx2")))
+static size_t hdlc_scan_avx2(const uint8_t *s, size_t len)
+{
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = hdlc_mask_avx2(s + i);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + hdlc_scan_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t hdlc_count_avx2(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		count += __builtin_popcount(hdlc_mask_avx2(s + i));
+
+	return count + hdlc_count_scalar(s + i, len - i);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static inline uint8x16_t hdlc_mask_neon(const uint8_t *s)
+{
+	uint8x16_t v = vld1q_u8(s);
+
+	return vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x7d)),
+			vceqq_u8(v, vdupq_n_u8(0x7e)));
+}
+
+static size_t hdlc_scan_neon(const uint8_t *s, size_t len)
+{
+	uint16x8_t mask;
+	uint64_t bits;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		/* Narrow the mask to one nibble per byte */
+		mask = vreinterpretq_u16_u8(hdlc_mask_neon(s + i));
+		bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(mask, 4)),
+				     0);
+		if (bits)
+			return i + (__builtin_ctzll(bits) >> 2);
+	}
+
+	return i + hdlc_scan_scalar(s + i, len - i);
+}
+
+static size_t hdlc_count_neon(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		count += vaddvq_u8(vandq_u8(hdlc_mask_neon(s + i),
+					    vdupq_n_u8(1)));
+
+	return count + hdlc_count_scalar(s + i, len - i);
+}
+#endif
+
+static size_t (*hdlc_scan)(const uint8_t *s, size_t len) = hdlc_scan_scalar;
+static size_t (*hdlc_count)(const uint8_t *s, size_t len) = hdlc_count_scalar;
+static uint16_t (*hdlc_crc)(uint16_t crc, const uint8_t *s, size_t len) = hdlc_crc_bytes;
+
+/*
+ * Pick the implementations for the running CPU, before main() and any other
+ * thread may use them.
+ */
+__attribute__((constructor))
+static void hdlc_simd_init(void)
+{
+	hdlc_crc_slice_init();
+	hdlc_crc = hdlc_crc_slice8;
+
+#if defined(HDLC_HAVE_CLMUL)
+	hdlc_crc_fold_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2"))
+		hdlc_crc = hdlc_crc_clmul;
+#elif defined(HDLC_HAVE_PMULL)
+	hdlc_crc_fold_init();
+	hdlc_crc = hdlc_crc_pmull;
+#endif
+
+#ifdef HDLC_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		hdlc_scan = hdlc_scan_avx2;
+		hdlc_count = hdlc_count_avx2;
+		return;
+	}
+#endif
+
+#if defined(__SSE2__)
+	hdlc_scan = hdlc_scan_sse2;
+	hdlc_count = hdlc_count_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	hdlc_scan = hdlc_scan_neon;
+	hdlc_count = hdlc_count_neon;
+#else
+	hdlc_scan = hdlc_scan_scalar;
+	hdlc_count = hdlc_count_scalar;
+#endif
+}
+
+/**
+ * hdlc_crc_update() - accumulate the HDLC frame check of a buffer
+ * @crc:	CRC of the preceding data, HDLC_CRC_INIT to start
+ * @buf:	the data
+ * @len:	length of @buf
+ *
+ * The frame check sequence of the message is the complement of the final
+ * value, transmitted least significant byte first.
+ *
+ * Return: CRC of the preceding data and @buf
+ */
+uint16_t hdlc_crc_update(uint16_t crc, const void *buf, size_t len)
+{
+	return hdlc_crc(crc, buf, len);
+}
+
+/* Bytes handled one at a time following an escape, before scanning again */
+#define HDLC_ESCAPE_TAIL	16
+
+/*
+ * Escape @len bytes from @s into @d, copying the runs in between bytes that
+ * need escaping in bulk. The bytes following an escape are handled one at a
+ * time, for data dense with escapes not to cost a scan per byte, without
+ * branching on their value; this writes one byte beyond the escaped data,
+ * which is fine as the frame is always terminated by a flag.
+ */
+static uint8_t *hdlc_escape(uint8_t *d, const uint8_t *s, size_t len)
+{
+	const uint8_t *end = s + len;
+	const uint8_t *tail;
+	bool special;
+	size_t n;
+	uint8_t ch;
 
-	d = dst;
 	while (s < end) {
-		crc = hdlc_crc_byte(crc, *s);
+		n = hdlc_scan(s, end - s);
+		memcpy(d, s, n);
+		d += n;
+		s += n;
 
-		if (*s == 0x7d || *s == 0x7e) {
-			*d++ = 0x7d;
-			*d++ = *s++ ^ 0x20;
-		} else {
-			*d++ = *s++;
+		tail = s + MIN(HDLC_ESCAPE_TAIL, end - s);
+		while (s < tail) {
+			ch = *s++;
+			special = hdlc_special(ch);
+
+			d[0] = special ? 0x7d : ch;
+			d[1] = ch ^ 0x20;
+			d += 1 + special;
 		}
 	}
 
+	return d;
+}
+
+/**
+ * hdlc_encode_size_iov() - size needed to HDLC encode a scattered message
+ * @iov:	the fragments of the message
+ * @iovcnt:	number of entries in @iov
+ *
+ * Escapes within the message are counted, while both bytes of the CRC are
+ * assumed to need escaping, so this is at most two bytes above the size
+ * hdlc_encode_iov() will produce.
+ *
+ * Return: number of bytes needed for the encoded message
+ */
+size_t hdlc_encode_size_iov(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 2 * 2 + 1;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		size += iov[i].iov_len;
+		size += hdlc_count(iov[i].iov_base, iov[i].iov_len);
+	}
+
+	return size;
+}
+
+/**
+ * hdlc_encode_iov() - HDLC encode a scattered message into a buffer
+ * @dst:	destination buffer, of at least hdlc_encode_size_iov() bytes
+ * @iov:	the fragments of the message
+ * @iovcnt:	number of entries in @iov
+ *
+ * Return: number of bytes written to @dst
+ */
+size_t hdlc_encode_iov(void *dst, const struct iovec *iov, int iovcnt)
+{
+	uint16_t crc = HDLC_CRC_INIT;
+	uint8_t tmp[2];
+	uint8_t *d = dst;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		crc = hdlc_crc(crc, iov[i].iov_base, iov[i].iov_len);
+		d = hdlc_escape(d, iov[i].iov_base, iov[i].iov_len);
+	}
+
 	tmp[0] = ~crc & 0xff;
 	tmp[1] = ~crc >> 8;
 
-	s = tmp;
-	for (i = 0; i < 2; i++) {
-		if (*s == 0x7d || *s == 0x7e) {
-			*d++ = 0x7d;
-			*d++ = *s++ ^ 0x20;
-		} else {
-			*d++ = *s++;
-		}
-	}
+	d = hdlc_escape(d, tmp, 2);
 
 	*d++ = 0x7e;
-	*dlen = d - dst;
+
+	return d - (uint8_t *)dst;
+}
+
+/**
+ * hdlc_encode_size() - size needed to HDLC encode a message
+ * @src:	the message
+ * @slen:	length of @src
+ *
+ * Return: number of bytes needed for the encoded message, see
+ * hdlc_encode_size_iov()
+ */
+size_t hdlc_encode_size(const void *src, size_t slen)
+{
+	struct iovec iov = { (void *)src, slen };
+
+	return hdlc_encode_size_iov(&iov, 1);
+}
+
+/**
+ * hdlc_encode_buf() - HDLC encode a message into a buffer
+ * @dst:	destination buffer, of at least hdlc_encode_size() bytes
+ * @src:	the message
+ * @slen:	length of @src
+ *
+ * Return: number of bytes written to @dst
+ */
+size_t hdlc_encode_buf(void *dst, const void *src, size_t slen)
+{
+	struct iovec iov = { (void *)src, slen };
+
+	return hdlc_encode_iov(dst, &iov, 1);
+}
+
+void *hdlc_encode(const void *src, size_t slen, size_t *dlen)
+{
+	void *dst;
+
+	dst = malloc((slen + 2) * 2 + 1);
+	if (!dst)
+		return NULL;
+
+	*dlen = hdlc_encode_buf(dst, src, slen);
 
 	return dst;
 }
 
+/**
+ * hdlc_batch_init() - start a batch of frames in a transfer buffer
+ * @batch:	batch object
+ * @buf:	transfer buffer the frames are encoded into
+ * @size:	size of @buf
+ */
+void hdlc_batch_init(struct hdlc_batch *batch, void *buf, size_t size)
+{
+	batch->buf = buf;
+	batch->size = size;
+	batch->len = 0;
+}
+
+/**
+ * hdlc_batch_add_iov() - append a scattered message to a batch of frames
+ * @batch:	batch object
+ * @iov:	the fragments of the message
+ * @iovcnt:	number of entries in @iov
+ *
+ * The message is encoded, with its frame check and terminating flag, at
+ * offset @batch->len of the transfer buffer. Room is only measured exactly
+ * when the worst case encoding of the message doesn't fit.
+ *
+ * Return: length of the frame, or -ENOSPC if it doesn't fit in the remaining
+ * room, in which case the batch is left unchanged
+ */
+ssize_t hdlc_batch_add_iov(struct hdlc_batch *batch, const struct iovec *iov,
+			   int iovcnt)
+{
+	size_t room = batch->size - batch->len;
+	size_t len = 0;
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if ((len + 2) * 2 + 1 > room &&
+	    hdlc_encode_size_iov(iov, iovcnt) > room)
+		return -ENOSPC;
+
+	n = hdlc_encode_iov((char *)batch->buf + batch->len, iov, iovcnt);
+	batch->len += n;
+
+	return n;
+}
+
+/**
+ * hdlc_batch_add() - append a message to a batch of frames
+ * @batch:	batch object
+ * @msg:	the message
+ * @msglen:	length of @msg
+ *
+ * Return: length of the frame, or -ENOSPC if it doesn't fit, see
+ * hdlc_batch_add_iov()
+ */
+ssize_t hdlc_batch_add(struct hdlc_batch *batch, const void *msg, size_t msglen)
+{
+	struct iovec iov = { (void *)msg, msglen };
+
+	return hdlc_batch_add_iov(batch, &iov, 1);
+}
+
+/**
+ * hdlc_encode_batch() - HDLC encode a sequence of messages into one buffer
+ * @batch:	batch object
+ * @msgs:	the messages
+ * @nmsgs:	number of entries in @msgs
+ *
+ * Messages are appended in order until one doesn't fit.
+ *
+ * Return: number of messages encoded
+ */
+int hdlc_encode_batch(struct hdlc_batch *batch, const struct iovec *msgs,
+		      int nmsgs)
+{
+	int i;
+
+	for (i = 0; i < nmsgs; i++) {
+		if (hdlc_batch_add_iov(batch, &msgs[i], 1) < 0)
+			break;
+	}
+
+	return i;
+}
+
+/* Largest message decoded, frames beyond this are discarded */
+static size_t hdlc_max_frame = HDLC_MAX_FRAME;
+
+/**
+ * hdlc_set_max_frame() - configure the largest message to decode
+ * @size:	size of the largest message, excluding the frame check
+ *
+ * Decoders start out with HDLC_BUF_SIZE bytes and grow their buffer as larger
+ * frames are received, larger frames are discarded and counted as oversize.
+ */
+void hdlc_set_max_frame(size_t size)
+{
+	hdlc_max_frame = size;
+}
+
+static inline size_t hdlc_decoder_room(struct hdlc_decoder *hdlc, uint8_t *raw)
+{
+	return hdlc->size - (raw - (uint8_t *)hdlc->raw_buf);
+}
+
+/*
+ * Make room for @n bytes more at *@raw, growing the buffer up to the largest
+ * frame permitted, and rebase the pointers into it.
+ *
+ * Return: true if there's room, false if the frame is to be discarded
+ */
+static bool hdlc_decoder_grow(struct hdlc_decoder *hdlc, uint8_t **raw,
+			      uint8_t **start, size_t n)
+{
+	size_t max = hdlc_max_frame + 2;
+	size_t used = *raw - (uint8_t *)hdlc->raw_buf;
+	size_t size;
+	char *buf;
+
+	if (used + n > max)
+		return false;
+
+	size = MIN(MAX(hdlc->size * 2, used + n), max);
+	buf = realloc(hdlc->raw_buf, size);
+	if (!buf)
+		return false;
+
+	*start = (uint8_t *)buf + (*start - (uint8_t *)hdlc->raw_buf);
+	*raw = (uint8_t *)buf + used;
+
+	hdlc->raw_buf = buf;
+	hdlc->size = size;
+
+	return true;
+}
+
+static void hdlc_decoder_reset(struct hdlc_decoder *hdlc)
+{
+	hdlc->raw = hdlc->raw_buf;
+	hdlc->crc = HDLC_CRC_INIT;
+	hdlc->escape = 0;
+	hdlc->discard = false;
+}
+
+/**
+ * hdlc_decode_one() - decode the next valid frame from a buffer
+ * @hdlc:	decoder state, carried over between calls
+ * @buf:	buffer of received data, from which the decoded data is consumed
+ * @msglen:	set to the length of the returned message
+ *
+ * The runs between flags and escapes are copied in bulk and the frame check
+ * accumulated as they are, so a frame is validated as soon as its terminating
+ * flag is found. Frames failing the check, or larger than the configured
+ * maximum, are counted and skipped; the remainder of an oversized frame is
+ * skipped by searching for its flag alone.
+ *
+ * Return: the message, valid until the next call, or NULL if no complete
+ * frame remains in @buf
+ */
 void *hdlc_decode_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
 		      size_t *msglen)
 {
+	const uint8_t *data = (const uint8_t *)CIRC_DATA(buf);
+	const uint8_t *end = data + CIRC_CNT(buf);
+	const uint8_t *s = data;
+	const uint8_t *flag;
+	const uint8_t *tail;
+	uint8_t *start;
+	uint8_t *raw;
+	bool complete;
+	bool special;
 	uint8_t ch;
+	size_t len;
+	size_t n;
+
+	if (s == end)
+		return NULL;
 
-	if (!hdlc->raw)
-		hdlc->raw = hdlc->raw_buf;
+	if (!hdlc->raw_buf) {
+		hdlc->size = MIN(HDLC_BUF_SIZE, hdlc_max_frame + 2);
+		hdlc->raw_buf = malloc(hdlc->size);
+		if (!hdlc->raw_buf)
+			return NULL;
+
+		hdlc_decoder_reset(hdlc);
+	}
 
 	for (;;) {
-		if (buf->tail == buf->head)
-			return 0;
+		start = raw = (uint8_t *)hdlc->raw;
+		complete = false;
 
-		ch = buf->buf[buf->tail];
-		buf->tail = (buf->tail + 1) & (HDLC_BUF_SIZE - 1);
+		/* The buffered data is contiguous, even across the end of the ring */
+		while (s < end) {
+			if (hdlc->discard) {
+				flag = memchr(s, 0x7e, end - s);
+				s = flag ? flag + 1 : end;
+				complete = !!flag;
+				break;
+			}
+
+			n = hdlc_scan(s, end - s);
+			if (n) {
+				if (n > hdlc_decoder_room(hdlc, raw) &&
+				    !hdlc_decoder_grow(hdlc, &raw, &start, n)) {
+					hdlc->discard = true;
+				} else {
+					memcpy(raw, s, n);
+					raw[0] ^= hdlc->escape;
+					raw += n;
+				}
+
+				hdlc->escape = 0;
+				s += n;
+				if (s == end)
+					break;
+			}
+
+			if (*s++ == 0x7e) {
+				complete = true;
+				break;
+			}
 
-		if (ch == 0x7e) {
-			break;
-		} else if (ch == 0x7d) {
 			hdlc->escape = 0x20;
-		} else {
-			*hdlc->raw++ = ch ^ hdlc->escape;
-			hdlc->escape = 0;
+
+			if (hdlc_decoder_room(hdlc, raw) < HDLC_ESCAPE_TAIL)
+				continue;
+
+			/* As in hdlc_escape(), the escape is applied branch free */
+			tail = s + MIN(HDLC_ESCAPE_TAIL, end - s);
+			while (s < tail && *s != 0x7e) {
+				ch = *s++;
+				special = ch == 0x7d;
+
+				*raw = ch ^ hdlc->escape;
+				raw += !special;
+				hdlc->escape = special ? 0x20 : 0;
+			}
 		}
 
-	}
+		hdlc->crc = hdlc_crc(hdlc->crc, start, raw - start);
+		hdlc->raw = (char *)raw;
 
-	if (hdlc->raw == hdlc->raw_buf)
-		return NULL;
+		if (!complete)
+			break;
 
-	hdlc->raw--;
-	hdlc->raw--;
+		len = hdlc->raw - hdlc->raw_buf;
+		if (hdlc->discard) {
+			__atomic_add_fetch(&hdlc->oversize, 1, __ATOMIC_RELAXED);
+		} else if (len && (len < 2 || hdlc->crc != HDLC_CRC_GOOD)) {
+			__atomic_add_fetch(&hdlc->crc_errors, 1, __ATOMIC_RELAXED);
+		} else if (len > 2) {
+			circ_consume(buf, s - data);
+			hdlc_decoder_reset(hdlc);
 
-	*msglen = hdlc->raw - hdlc->raw_buf;
+			*msglen = len - 2;
+			return hdlc->raw_buf;
+		}
 
-	hdlc->raw = hdlc->raw_buf;
-	hdlc->escape = 0;
+		hdlc_decoder_reset(hdlc);
+	}
 
-	return hdlc->raw_buf;
+	circ_consume(buf, s - data);
+
+	return NULL;
+}
+
+/**
+ * hdlc_decoder_stats() - accumulate the frames dropped by a decoder
+ * @hdlc:	the decoder, possibly in use by another thread
+ * @crc_errors:	incremented by the number of frames failing the frame check
+ * @oversize:	incremented by the number of frames too large to decode
+ */
+void hdlc_decoder_stats(const struct hdlc_decoder *hdlc,
+			unsigned long *crc_errors, unsigned long *oversize)
+{
+	*crc_errors += __atomic_load_n(&hdlc->crc_errors, __ATOMIC_RELAXED);
+	*oversize += __atomic_load_n(&hdlc->oversize, __ATOMIC_RELAXED);
+}
+
+/**
+ * hdlc_decoder_release() - free the buffer of a decoder
+ * @hdlc:	the decoder
+ *
+ * A partially decoded frame is discarded.
+ */
+void hdlc_decoder_release(struct hdlc_decoder *hdlc)
+{
+	free(hdlc->raw_buf);
+	hdlc->raw_buf = NULL;
+	hdlc_decoder_reset(hdlc);
 }
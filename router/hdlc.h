@@ -32,22 +32,69 @@
 #ifndef __HDLC_H__
 #define __HDLC_H__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "circ_buf.h"
 
 struct circ_buf;
 
+#define HDLC_CRC_INIT	0xffff
+
+/*
+ * Frames of a batch are encoded back to back into @buf, of @size bytes, of
+ * which the first @len are used.
+ */
+struct hdlc_batch {
+	void *buf;
+	size_t size;
+	size_t len;
+};
+
+/* Default largest message decoded, see hdlc_set_max_frame() */
+#define HDLC_MAX_FRAME	(64 * 1024)
+
+/*
+ * @raw_buf is allocated, HDLC_BUF_SIZE bytes, as the first frame is decoded,
+ * grown to @size bytes as larger frames arrive and freed by
+ * hdlc_decoder_release(). Frames failing the frame check are counted in
+ * @crc_errors and those exceeding the largest message size in @oversize.
+ */
 struct hdlc_decoder {
-	char raw_buf[HDLC_BUF_SIZE];
+	char *raw_buf;
 	char *raw;
+	size_t size;
 
+	uint16_t crc;
 	uint8_t escape;
+	bool discard;
+
+	unsigned long crc_errors;
+	unsigned long oversize;
 };
 
+uint16_t hdlc_crc_update(uint16_t crc, const void *buf, size_t len);
+
 void *hdlc_encode(const void *src, size_t slen, size_t *dlen);
+size_t hdlc_encode_size(const void *src, size_t slen);
+size_t hdlc_encode_buf(void *dst, const void *src, size_t slen);
+size_t hdlc_encode_size_iov(const struct iovec *iov, int iovcnt);
+size_t hdlc_encode_iov(void *dst, const struct iovec *iov, int iovcnt);
+
+void hdlc_batch_init(struct hdlc_batch *batch, void *buf, size_t size);
+ssize_t hdlc_batch_add_iov(struct hdlc_batch *batch, const struct iovec *iov,
+			   int iovcnt);
+ssize_t hdlc_batch_add(struct hdlc_batch *batch, const void *msg, size_t msglen);
+int hdlc_encode_batch(struct hdlc_batch *batch, const struct iovec *msgs,
+		      int nmsgs);
 
 void *hdlc_decode_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
 		      size_t *msglen);
+void hdlc_set_max_frame(size_t size);
+void hdlc_decoder_stats(const struct hdlc_decoder *hdlc,
+			unsigned long *crc_errors, unsigned long *oversize);
+void hdlc_decoder_release(struct hdlc_decoder *hdlc);
 
 #endif
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/eventfd.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diag.h"
+#include "dm.h"
+#include "hdlc.h"
+#include "ingress.h"
+#include "mbuf.h"
+#include "peripheral.h"
+#include "spsc_ring.h"
+#include "watch.h"
+
+/**
+ * DOC: Threaded peripheral ingress
+ *
+ * In threaded mode the data channel of a peripheral is read and deframed on
+ * a dedicated thread. Messages are handed to the router thread in mbufs,
+ * over a single producer, single consumer ring. The router thread drains
+ * the ring into the DMs for as long as the peripheral's flow allows; once
+ * it stops draining the ring fills up and the ingress thread stops reading
+ * the channel, so flow control carries over to the peripheral.
+ */
+
+/* Number of messages that can be in transit to the router thread */
+#define INGRESS_RING_SIZE	256
+
+/**
+ * struct ingress - ingress thread context
+ * @peripheral:	peripheral whose data channel is being read
+ * @fd:		the non-blocking data channel
+ * @ring:	messages read, waiting to be dispatched
+ * @ready_fd:	eventfd signalling the router thread of queued messages
+ * @wake_fd:	eventfd signalling the ingress thread of space, or stop
+ * @stop:	ingress thread is requested to terminate
+ * @waiting:	ingress thread is waiting for space in @ring
+ * @done:	ingress thread has terminated
+ * @error:	negative errno the ingress thread terminated with
+ * @thread:	the ingress thread
+ * @recv_buf:	data read, waiting to be deframed
+ * @recv_decoder: HDLC decoder state
+ */
+struct ingress {
+	struct peripheral *peripheral;
+	int fd;
+
+	struct spsc_ring *ring;
+
+	int ready_fd;
+	int wake_fd;
+
+	bool stop;
+	bool waiting;
+	bool done;
+	int error;
+
+	pthread_t thread;
+
+	struct circ_buf recv_buf;
+	struct hdlc_decoder recv_decoder;
+};
+
+bool peripheral_ingress_threads;
+
+static void ingress_signal(int fd)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	n = write(fd, &one, sizeof(one));
+	if (n < 0)
+		warn("failed to signal eventfd");
+}
+
+static void ingress_clear(int fd)
+{
+	uint64_t cnt;
+	ssize_t n;
+
+	n = read(fd, &cnt, sizeof(cnt));
+	if (n < 0 && errno != EAGAIN)
+		warn("failed to clear eventfd");
+}
+
+static bool ingress_stopped(struct ingress *ingress)
+{
+	return __atomic_load_n(&ingress->stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait for the router thread to make room in the ring, returns -ECANCELED
+ * if the thread is asked to stop while waiting.
+ */
+static int ingress_wait(struct ingress *ingress)
+{
+	struct pollfd pfd = {
+		.fd = ingress->wake_fd,
+		.events = POLLIN,
+	};
+
+	/* The router thread might not have seen the last few messages */
+	ingress_signal(ingress->ready_fd);
+
+	for (;;) {
+		/*
+		 * Publish the intent to wait before checking for space, so that
+		 * the router thread either sees the flag or we see the space.
+		 */
+		__atomic_store_n(&ingress->waiting, true, __ATOMIC_SEQ_CST);
+		if (!spsc_ring_full(ingress->ring))
+			break;
+
+		if (ingress_stopped(ingress))
+			return -ECANCELED;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+
+		ingress_clear(ingress->wake_fd);
+	}
+
+	__atomic_store_n(&ingress->waiting, false, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static int ingress_queue(struct ingress *ingress, const void *msg, size_t len)
+{
+	struct mbuf *mbuf;
+	void *ptr;
+	int ret;
+
+	/*
+	 * Leave room for the router thread to frame the message in place. Drop
+	 * the message if the mbuf pools are exhausted, accounted by the pools,
+	 * rather than tear down the channel.
+	 */
+	mbuf = diag_mbuf_alloc(len);
+	if (!mbuf)
+		return 0;
+
+	ptr = mbuf_put(mbuf, len);
+	memcpy(ptr, msg, len);
+
+	while (!spsc_ring_push(ingress->ring, mbuf)) {
+		ret = ingress_wait(ingress);
+		if (ret < 0) {
+			mbuf_free(mbuf);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int ingress_read_raw(struct ingress *ingress)
+{
+	uint8_t buf[4096];
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		n = read(ingress->fd, buf, sizeof(buf));
+		if (n < 0)
+			return -errno;
+		else if (!n)
+			return -EPIPE;
+
+		ret = ingress_queue(ingress, buf, n);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+static int ingress_read_hdlc(struct ingress *ingress)
+{
+	size_t msglen;
+	ssize_t n;
+	void *msg;
+	int ret;
+
+	for (;;) {
+		n = circ_read(ingress->fd, &ingress->recv_buf);
+		if (n < 0)
+			n = -errno;
+
+		/* Deframe what was read, even if the read then failed */
+		for (;;) {
+			msg = hdlc_decode_one(&ingress->recv_decoder,
+					      &ingress->recv_buf, &msglen);
+			if (!msg)
+				break;
+
+			ret = ingress_queue(ingress, msg, msglen);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (n < 0)
+			return n;
+	}
+}
+
+static void *ingress_thread(void *data)
+{
+	struct ingress *ingress = data;
+	struct peripheral *peripheral = ingress->peripheral;
+	unsigned long features;
+	struct pollfd pfd[2] = {
+		{ .fd = ingress->fd, .events = POLLIN },
+		{ .fd = ingress->wake_fd, .events = POLLIN },
+	};
+	int ret;
+
+	for (;;) {
+		/* The features are renegotiated by the router thread */
+		features = __atomic_load_n(&peripheral->features,
+					   __ATOMIC_RELAXED);
+
+		if (features & DIAG_FEATURE_APPS_HDLC_ENCODE)
+			ret = ingress_read_raw(ingress);
+		else
+			ret = ingress_read_hdlc(ingress);
+		if (ret != -EAGAIN)
+			break;
+
+		/* Hand over everything deframed from this batch of reads */
+		ingress_signal(ingress->ready_fd);
+
+		ret = poll(pfd, 2, -1);
+		if (ret < 0 && errno != EINTR) {
+			ret = -errno;
+			break;
+		}
+
+		if (pfd[1].revents)
+			ingress_clear(ingress->wake_fd);
+
+		if (ingress_stopped(ingress)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret == -ECANCELED)
+		ret = 0;
+
+	ingress->error = ret;
+	__atomic_store_n(&ingress->done, true, __ATOMIC_RELEASE);
+	ingress_signal(ingress->ready_fd);
+
+	return NULL;
+}
+
+/* Dispatch the messages of the ring to the DMs, on the router thread */
+static int ingress_dispatch(int fd, void *data)
+{
+	struct ingress *ingress = data;
+	struct peripheral *peripheral = ingress->peripheral;
+	struct mbuf *mbuf = NULL;
+	unsigned int packets = 0;
+	bool drained = false;
+	size_t bytes = 0;
+	bool done;
+
+	ingress_clear(fd);
+
+	/* Sample before draining, so no message can be left behind */
+	done = __atomic_load_n(&ingress->done, __ATOMIC_ACQUIRE);
+
+	while (!watch_flow_blocked(peripheral->flow)) {
+		/* mbuf is left non-NULL, so the watch is signalled below */
+		if (peripheral_budget_spent(peripheral, packets, bytes))
+			break;
+
+		mbuf = spsc_ring_pop(ingress->ring);
+		if (!mbuf)
+			break;
+
+		packets++;
+		bytes += mbuf_len(mbuf);
+
+		dm_broadcast_mbuf(mbuf, peripheral->flow);
+
+		drained = true;
+	}
+
+	if (drained) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_exchange_n(&ingress->waiting, false, __ATOMIC_SEQ_CST))
+			ingress_signal(ingress->wake_fd);
+	}
+
+	/*
+	 * Flow control kicked in, or the budget ran out, with messages left
+	 * in the ring, make sure the watch fires again on a later iteration
+	 * or as the flow is unblocked.
+	 */
+	if (mbuf) {
+		ingress_signal(fd);
+		return 0;
+	}
+
+	if (done) {
+		if (ingress->error) {
+			errno = -ingress->error;
+			warn("failed to read from data channel");
+		}
+
+		/* Releases the ingress context */
+		peripheral_close(peripheral);
+	}
+
+	return 0;
+}
+
+/**
+ * ingress_start() - read a peripheral's data channel on a dedicated thread
+ * @peripheral:	the peripheral
+ * @fd:		the non-blocking data channel
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int ingress_start(struct peripheral *peripheral, int fd)
+{
+	struct ingress *ingress;
+	int ret;
+
+	ingress = calloc(1, sizeof(*ingress));
+	if (!ingress)
+		return -ENOMEM;
+
+	ingress->peripheral = peripheral;
+	ingress->fd = fd;
+
+	circ_init(&ingress->recv_buf, peripheral->name, HDLC_BUF_SIZE);
+
+	ingress->ring = spsc_ring_alloc(INGRESS_RING_SIZE);
+	if (!ingress->ring) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	ingress->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ingress->ready_fd < 0) {
+		ret = -errno;
+		goto err_free_ring;
+	}
+
+	ingress->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ingress->wake_fd < 0) {
+		ret = -errno;
+		goto err_close_ready;
+	}
+
+	ret = pthread_create(&ingress->thread, NULL, ingress_thread, ingress);
+	if (ret) {
+		ret = -ret;
+		goto err_close_wake;
+	}
+
+	/* Gate the dispatch, rather than the read, by the peripheral's flow */
+	watch_add_readfd(ingress->ready_fd, ingress_dispatch, ingress,
+			 peripheral->flow);
+	watch_set_name(ingress->ready_fd, peripheral->name);
+
+	peripheral->ingress = ingress;
+
+	return 0;
+
+err_close_wake:
+	close(ingress->wake_fd);
+err_close_ready:
+	close(ingress->ready_fd);
+err_free_ring:
+	spsc_ring_free(ingress->ring);
+err_free:
+	free(ingress);
+
+	return ret;
+}
+
+/**
+ * ingress_decoder_stats() - accumulate the frames dropped by an ingress thread
+ * @peripheral:	the peripheral
+ * @crc_errors:	incremented by the number of frames failing the frame check
+ * @oversize:	incremented by the number of frames too large to decode
+ */
+void ingress_decoder_stats(struct peripheral *peripheral,
+			   unsigned long *crc_errors, unsigned long *oversize)
+{
+	if (peripheral->ingress)
+		hdlc_decoder_stats(&peripheral->ingress->recv_decoder,
+				   crc_errors, oversize);
+}
+
+/**
+ * ingress_stop() - stop the ingress thread of a peripheral
+ * @peripheral:	the peripheral
+ *
+ * Messages not yet dispatched are dropped.
+ */
+void ingress_stop(struct peripheral *peripheral)
+{
+	struct ingress *ingress = peripheral->ingress;
+	struct mbuf *mbuf;
+
+	if (!ingress)
+		return;
+
+	__atomic_store_n(&ingress->stop, true, __ATOMIC_RELEASE);
+	ingress_signal(ingress->wake_fd);
+
+	pthread_join(ingress->thread, NULL);
+
+	watch_remove_fd(ingress->ready_fd);
+
+	/* Keep the count of dropped frames with the peripheral */
+	hdlc_decoder_stats(&ingress->recv_decoder,
+			   &peripheral->recv_decoder.crc_errors,
+			   &peripheral->recv_decoder.oversize);
+
+	while ((mbuf = spsc_ring_pop(ingress->ring)) != NULL)
+		mbuf_free(mbuf);
+
+	close(ingress->ready_fd);
+	close(ingress->wake_fd);
+	spsc_ring_free(ingress->ring);
+	circ_release(&ingress->recv_buf);
+	hdlc_decoder_release(&ingress->recv_decoder);
+	free(ingress);
+
+	peripheral->ingress = NULL;
+}
@@ -28,24 +28,474 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
 #include "mbuf.h"
+#include "util.h"
+
+/*
+ * mbufs are carved from power-of-two size classes, from 64 bytes to 64kB of
+ * payload, each with its own free list. Buffers are returned to the free
+ * list of their class as they are released, so once the pools have grown to
+ * the working set no heap calls are made. Larger buffers are allocated from
+ * the heap directly.
+ *
+ * With an arena, see mbuf_arena_init(), the pools grow from locked memory
+ * instead of the heap, and allocations fail once it's used up.
+ *
+ * The pools are shared with the peripheral ingress threads, hence the lock.
+ */
+#define MBUF_CLASS_MIN_SHIFT	6
+#define MBUF_CLASS_MAX_SHIFT	16
+#define MBUF_CLASSES		(MBUF_CLASS_MAX_SHIFT - MBUF_CLASS_MIN_SHIFT + 1)
+
+#define MBUF_UNPOOLED		-1
+
+/**
+ * struct mbuf_class - pool of equally sized mbufs
+ * @free:	list of free mbufs
+ * @total:	number of mbufs owned by the pool, free and in use
+ * @in_use:	number of mbufs currently handed out
+ * @high_water:	largest value of @in_use seen
+ * @allocs:	number of mbuf_alloc() calls served by the pool
+ * @misses:	number of those that had to grow the pool
+ * @exhausted:	number of those that failed, the arena being used up
+ */
+struct mbuf_class {
+	struct list_head free;
+
+	unsigned int total;
+	unsigned int in_use;
+	unsigned int high_water;
+
+	unsigned long allocs;
+	unsigned long misses;
+	unsigned long exhausted;
+};
+
+static struct mbuf_class mbuf_classes[MBUF_CLASSES];
+static unsigned int mbuf_unpooled;
+static unsigned int mbuf_unpooled_high_water;
+static unsigned long mbuf_unpooled_allocs;
+static unsigned long mbuf_unpooled_exhausted;
+
+static char *mbuf_arena;
+static size_t mbuf_arena_size;
+static size_t mbuf_arena_used;
+
+static pthread_mutex_t mbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t mbuf_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int mbuf_class_of(size_t size)
+{
+	int shift = MBUF_CLASS_MIN_SHIFT;
+
+	if (size > 1UL << MBUF_CLASS_MAX_SHIFT)
+		return MBUF_UNPOOLED;
+
+	while ((1UL << shift) < size)
+		shift++;
+
+	return shift - MBUF_CLASS_MIN_SHIFT;
+}
+
+static size_t mbuf_class_size(int class)
+{
+	return 1UL << (class + MBUF_CLASS_MIN_SHIFT);
+}
+
+static void mbuf_pool_init(void)
+{
+	static bool initialized;
+	int i;
+
+	if (initialized)
+		return;
+
+	for (i = 0; i < MBUF_CLASSES; i++)
+		list_init(&mbuf_classes[i].free);
+
+	initialized = true;
+}
+
+/* Allocate a new mbuf for a pool, called with mbuf_lock held */
+static struct mbuf *mbuf_class_grow(int class)
+{
+	size_t size = sizeof(struct mbuf) + mbuf_class_size(class);
+	struct mbuf *mbuf;
+
+	if (!mbuf_arena)
+		return malloc(size);
+
+	/* Keep the mbufs carved from the arena aligned */
+	size = (size + 15) & ~(size_t)15;
+	if (mbuf_arena_used + size > mbuf_arena_size)
+		return NULL;
+
+	mbuf = (struct mbuf *)(mbuf_arena + mbuf_arena_used);
+	mbuf_arena_used += size;
+
+	return mbuf;
+}
+
+/* Called with mbuf_lock held */
+static struct mbuf *mbuf_class_get(int class)
+{
+	struct mbuf_class *mc = &mbuf_classes[class];
+	struct mbuf *mbuf;
+
+	mbuf_pool_init();
+
+	mc->allocs++;
+
+	if (!list_empty(&mc->free)) {
+		mbuf = list_entry_first(&mc->free, struct mbuf, node);
+		list_del(&mbuf->node);
+	} else {
+		mbuf = mbuf_class_grow(class);
+		if (!mbuf) {
+			if (mbuf_arena)
+				mc->exhausted++;
+			return NULL;
+		}
+
+		mc->total++;
+		mc->misses++;
+	}
+
+	mc->in_use++;
+	mc->high_water = MAX(mc->high_water, mc->in_use);
+
+	return mbuf;
+}
+
+/**
+ * mbuf_pool_reserve() - preallocate mbufs
+ * @size:	payload size the mbufs should accommodate
+ * @count:	number of mbufs the pool should hold
+ *
+ * Grows the pool serving @size so that it owns at least @count mbufs, to
+ * avoid heap calls as the router ramps up. With an arena the mbufs are
+ * carved from it.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int mbuf_pool_reserve(size_t size, unsigned int count)
+{
+	struct mbuf_class *mc;
+	struct mbuf *mbuf;
+	int class;
+	int ret = 0;
+
+	class = mbuf_class_of(size);
+	if (class == MBUF_UNPOOLED)
+		return -EINVAL;
+
+	mc = &mbuf_classes[class];
+
+	pthread_mutex_lock(&mbuf_lock);
+	mbuf_pool_init();
+
+	while (mc->total < count) {
+		mbuf = mbuf_class_grow(class);
+		if (!mbuf) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		list_add(&mc->free, &mbuf->node);
+		mc->total++;
+	}
+
+	pthread_mutex_unlock(&mbuf_lock);
+
+	return ret;
+}
+
+/**
+ * mbuf_arena_init() - serve the mbuf pools from a locked arena
+ * @size:	size of the arena, in bytes
+ *
+ * The arena is mapped, populated and locked up front. From here on the
+ * pools grow from the arena rather than the heap, allocations beyond the
+ * largest pool fail, and so do allocations once the arena is used up, so
+ * that no page faults or heap calls are taken while forwarding.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int mbuf_arena_init(size_t size)
+{
+	void *arena;
+	int ret;
+
+	arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (arena == MAP_FAILED)
+		return -errno;
+
+	ret = mlock(arena, size);
+	if (ret < 0) {
+		ret = -errno;
+		munmap(arena, size);
+		return ret;
+	}
+
+	pthread_mutex_lock(&mbuf_lock);
+	mbuf_arena = arena;
+	mbuf_arena_size = size;
+	mbuf_arena_used = 0;
+	pthread_mutex_unlock(&mbuf_lock);
+
+	return 0;
+}
+
+/**
+ * mbuf_arena_get() - locate the arena the pools are served from
+ * @base:	set to the start of the arena
+ * @size:	set to the size of the arena, in bytes
+ *
+ * Return: true if the pools are served from an arena, false otherwise
+ */
+bool mbuf_arena_get(void **base, size_t *size)
+{
+	pthread_mutex_lock(&mbuf_lock);
+	*base = mbuf_arena;
+	*size = mbuf_arena_size;
+	pthread_mutex_unlock(&mbuf_lock);
+
+	return *base != NULL;
+}
 
 struct mbuf *mbuf_alloc(size_t size)
 {
 	struct mbuf *mbuf;
+	int class;
+
+	class = mbuf_class_of(size);
+
+	pthread_mutex_lock(&mbuf_lock);
+	if (class == MBUF_UNPOOLED && mbuf_arena) {
+		mbuf_unpooled_exhausted++;
+		mbuf = NULL;
+	} else if (class == MBUF_UNPOOLED) {
+		mbuf = malloc(sizeof(*mbuf) + size);
+		if (mbuf) {
+			mbuf_unpooled_allocs++;
+			mbuf_unpooled++;
+			mbuf_unpooled_high_water = MAX(mbuf_unpooled_high_water,
+						       mbuf_unpooled);
+		}
+	} else {
+		mbuf = mbuf_class_get(class);
+	}
+	pthread_mutex_unlock(&mbuf_lock);
 
-	mbuf = malloc(sizeof(*mbuf) + size);
 	if (!mbuf)
 		return NULL;
 
 	memset(mbuf, 0, sizeof(*mbuf));
 	mbuf->size = size;
+	mbuf->class = class;
+	mbuf->refs = 1;
+	mbuf->stamp = mbuf_now_ns();
+	mbuf->data = mbuf->buf;
 
 	return mbuf;
 }
 
+/**
+ * mbuf_stamp() - record the time a mbuf is queued
+ * @mbuf:	the mbuf
+ *
+ * Called as a buffer is queued for reading or writing, the queue latency
+ * reported for the buffer is measured from this point to its completion.
+ */
+void mbuf_stamp(struct mbuf *mbuf)
+{
+	mbuf->stamp = mbuf_now_ns();
+}
+
+static struct mbuf *mbuf_clone_one(struct mbuf *mbuf)
+{
+	struct mbuf *origin = mbuf->origin ? : mbuf;
+	struct mbuf *clone;
+
+	clone = mbuf_alloc(0);
+	if (!clone)
+		return NULL;
+
+	__atomic_add_fetch(&origin->refs, 1, __ATOMIC_RELAXED);
+
+	clone->origin = origin;
+	clone->data = mbuf->data;
+	clone->size = mbuf->size;
+	clone->offset = mbuf->offset;
+	clone->priority = mbuf->priority;
+
+	return clone;
+}
+
+/**
+ * mbuf_clone() - share the payload of a mbuf
+ * @mbuf:	mbuf holding the payload, possibly a chain of fragments
+ *
+ * The clone is queued independently of @mbuf, but refers to the same
+ * payload, which must not be modified from here on. Each fragment of a
+ * chain is cloned.
+ *
+ * Return: new mbuf, or NULL on allocation failure
+ */
+struct mbuf *mbuf_clone(struct mbuf *mbuf)
+{
+	struct mbuf *clone = NULL;
+	struct mbuf **tail = &clone;
+	struct mbuf *frag;
+
+	for (frag = mbuf; frag; frag = frag->next) {
+		*tail = mbuf_clone_one(frag);
+		if (!*tail) {
+			mbuf_free(clone);
+			return NULL;
+		}
+
+		tail = &(*tail)->next;
+	}
+
+	return clone;
+}
+
+/*
+ * Drop a reference to a single fragment, the fragments following it are
+ * owned by the chain and released by mbuf_free()
+ */
+static void mbuf_release(struct mbuf *mbuf)
+{
+	struct mbuf *origin;
+	struct mbuf_class *mc;
+
+	if (__atomic_sub_fetch(&mbuf->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	origin = mbuf->origin;
+
+	pthread_mutex_lock(&mbuf_lock);
+	if (mbuf->class == MBUF_UNPOOLED) {
+		mbuf_unpooled--;
+		free(mbuf);
+	} else {
+		mc = &mbuf_classes[mbuf->class];
+		mc->in_use--;
+		list_add(&mc->free, &mbuf->node);
+	}
+	pthread_mutex_unlock(&mbuf_lock);
+
+	if (origin)
+		mbuf_release(origin);
+}
+
+/**
+ * mbuf_free() - drop a reference to a mbuf
+ * @mbuf:	mbuf to release, may be NULL
+ *
+ * Each fragment of the chain is returned to its pool as its last reference
+ * is dropped, a clone drops its reference to the origin of the payload in
+ * turn.
+ */
+void mbuf_free(struct mbuf *mbuf)
+{
+	struct mbuf *next;
+
+	while (mbuf) {
+		next = mbuf->next;
+		mbuf_release(mbuf);
+		mbuf = next;
+	}
+}
+
+/**
+ * mbuf_len() - length of the message held in a mbuf chain
+ * @mbuf:	the mbuf
+ *
+ * Return: number of bytes in all fragments
+ */
+size_t mbuf_len(struct mbuf *mbuf)
+{
+	size_t len = 0;
+
+	for (; mbuf; mbuf = mbuf->next)
+		len += mbuf->offset;
+
+	return len;
+}
+
+/**
+ * mbuf_iov() - describe the message of a mbuf chain
+ * @mbuf:	the mbuf
+ * @iov:	iovec to fill out, one entry per fragment
+ * @max:	number of entries in @iov
+ *
+ * Return: number of entries used, or -EMSGSIZE if @iov is too short
+ */
+int mbuf_iov(struct mbuf *mbuf, struct iovec *iov, int max)
+{
+	int n = 0;
+
+	for (; mbuf; mbuf = mbuf->next) {
+		if (n == max)
+			return -EMSGSIZE;
+
+		iov[n].iov_base = mbuf->data;
+		iov[n].iov_len = mbuf->offset;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * mbuf_copydata() - copy out part of the message of a mbuf chain
+ * @mbuf:	the mbuf
+ * @off:	offset into the message
+ * @len:	number of bytes to copy
+ * @dst:	destination buffer
+ *
+ * Return: 0 on success, -EINVAL if the message is shorter than @off + @len
+ */
+int mbuf_copydata(struct mbuf *mbuf, size_t off, size_t len, void *dst)
+{
+	size_t n;
+
+	for (; mbuf && len; mbuf = mbuf->next) {
+		if (off >= mbuf->offset) {
+			off -= mbuf->offset;
+			continue;
+		}
+
+		n = MIN(len, mbuf->offset - off);
+		memcpy(dst, mbuf->data + off, n);
+
+		dst += n;
+		len -= n;
+		off = 0;
+	}
+
+	return len ? -EINVAL : 0;
+}
+
 void *mbuf_put(struct mbuf *mbuf, size_t size)
 {
 	void *ptr;
@@ -58,3 +508,141 @@ void *mbuf_put(struct mbuf *mbuf, size_t size)
 
 	return ptr;
 }
+
+/**
+ * mbuf_reserve() - reserve headroom in an empty mbuf
+ * @mbuf:	the mbuf
+ * @size:	number of bytes to reserve in front of the message
+ */
+void mbuf_reserve(struct mbuf *mbuf, size_t size)
+{
+	if (mbuf->offset || size > mbuf->size)
+		return;
+
+	mbuf->data += size;
+	mbuf->size -= size;
+}
+
+/**
+ * mbuf_push() - prepend to the message, using headroom
+ * @mbuf:	the mbuf
+ * @size:	number of bytes to prepend
+ *
+ * Return: pointer to the prepended bytes, or NULL if there's not enough
+ * headroom
+ */
+void *mbuf_push(struct mbuf *mbuf, size_t size)
+{
+	if (size > mbuf_headroom(mbuf))
+		return NULL;
+
+	mbuf->data -= size;
+	mbuf->size += size;
+	mbuf->offset += size;
+
+	return mbuf->data;
+}
+
+/**
+ * mbuf_pull() - strip bytes from the front of the message
+ * @mbuf:	the mbuf
+ * @size:	number of bytes to strip, they become headroom
+ *
+ * Return: pointer to the remaining message, or NULL if it's shorter than
+ * @size
+ */
+void *mbuf_pull(struct mbuf *mbuf, size_t size)
+{
+	if (size > mbuf->offset)
+		return NULL;
+
+	mbuf->data += size;
+	mbuf->size -= size;
+	mbuf->offset -= size;
+
+	return mbuf->data;
+}
+
+/**
+ * mbuf_trim() - strip bytes from the end of the message
+ * @mbuf:	the mbuf
+ * @len:	new length of the message, the rest becomes tailroom
+ *
+ * Fragments of a chain left empty are released.
+ */
+void mbuf_trim(struct mbuf *mbuf, size_t len)
+{
+	for (; mbuf; mbuf = mbuf->next) {
+		if (len <= mbuf->offset) {
+			mbuf->offset = len;
+			mbuf_free(mbuf->next);
+			mbuf->next = NULL;
+			return;
+		}
+
+		len -= mbuf->offset;
+	}
+}
+
+/**
+ * mbuf_headroom() - room available in front of the message
+ * @mbuf:	the mbuf
+ *
+ * Return: number of bytes that can be pushed
+ */
+size_t mbuf_headroom(struct mbuf *mbuf)
+{
+	struct mbuf *origin = mbuf->origin ? : mbuf;
+
+	return mbuf->data - origin->buf;
+}
+
+/**
+ * mbuf_tailroom() - room available behind the message
+ * @mbuf:	the mbuf
+ *
+ * Return: number of bytes that can be put
+ */
+size_t mbuf_tailroom(struct mbuf *mbuf)
+{
+	return mbuf->size - mbuf->offset;
+}
+
+/**
+ * mbuf_dump_stats() - print mbuf pool statistics
+ * @fp:		stream to print to
+ */
+void mbuf_dump_stats(FILE *fp)
+{
+	struct mbuf_class *mc;
+	int i;
+
+	pthread_mutex_lock(&mbuf_lock);
+
+	fprintf(fp, "mbuf pools:\n");
+	if (mbuf_arena)
+		fprintf(fp, "  arena: %zu of %zu bytes used\n",
+			mbuf_arena_used, mbuf_arena_size);
+
+	for (i = 0; i < MBUF_CLASSES; i++) {
+		mc = &mbuf_classes[i];
+		if (!mc->total && !mc->exhausted)
+			continue;
+
+		fprintf(fp, "  %zu bytes: total %u in use %u (max %u) allocs %lu %s %lu",
+			mbuf_class_size(i), mc->total, mc->in_use,
+			mc->high_water, mc->allocs,
+			mbuf_arena ? "arena" : "heap", mc->misses);
+		if (mbuf_arena)
+			fprintf(fp, " exhausted %lu", mc->exhausted);
+		fprintf(fp, "\n");
+	}
+
+	fprintf(fp, "  unpooled: in use %u (max %u) allocs %lu",
+		mbuf_unpooled, mbuf_unpooled_high_water, mbuf_unpooled_allocs);
+	if (mbuf_arena)
+		fprintf(fp, " exhausted %lu", mbuf_unpooled_exhausted);
+	fprintf(fp, "\n");
+
+	pthread_mutex_unlock(&mbuf_lock);
+}
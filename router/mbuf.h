@@ -31,22 +31,71 @@
 #ifndef __MBUF_H__
 #define __MBUF_H__
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
 #include "list.h"
 
+/* Most fragments a chain may consist of, to fit in one vectored write */
+#define MBUF_MAX_FRAGS		32
+
 struct watch_flow;
 
+/*
+ * An mbuf either carries its own payload, in @buf, or is a clone sharing the
+ * payload of @origin. Shared payloads are immutable, they are released as
+ * the last mbuf referencing them is freed.
+ *
+ * @data points @size bytes of room, of which the first @offset bytes hold
+ * the message; writes transmit @offset bytes, reads fill up to @size. Room
+ * reserved in front of @data (headroom) and behind the message (tailroom)
+ * allows headers and trailers to be added without moving the message.
+ *
+ * Large messages may be held in a chain of fragments, linked through @next,
+ * the head of the chain is what's queued and carries @flow, @priority and
+ * @stamp. @priority orders queued messages for dropping, lowest first.
+ * @stamp is the time the mbuf was last queued, see mbuf_stamp().
+ */
 struct mbuf {
 	struct list_head node;
 
 	size_t size;
 	size_t offset;
+	int class;
+
+	unsigned int refs;
+	struct mbuf *origin;
+	struct mbuf *next;
 
 	struct watch_flow *flow;
+	unsigned int priority;
 
-	char data[];
+	uint64_t stamp;
+
+	char *data;
+	char buf[];
 };
 
 struct mbuf *mbuf_alloc(size_t size);
+void mbuf_free(struct mbuf *mbuf);
+struct mbuf *mbuf_clone(struct mbuf *mbuf);
 void *mbuf_put(struct mbuf *mbuf, size_t size);
+void mbuf_stamp(struct mbuf *mbuf);
+void mbuf_reserve(struct mbuf *mbuf, size_t size);
+void *mbuf_push(struct mbuf *mbuf, size_t size);
+void *mbuf_pull(struct mbuf *mbuf, size_t size);
+void mbuf_trim(struct mbuf *mbuf, size_t len);
+size_t mbuf_len(struct mbuf *mbuf);
+int mbuf_iov(struct mbuf *mbuf, struct iovec *iov, int max);
+int mbuf_copydata(struct mbuf *mbuf, size_t off, size_t len, void *dst);
+size_t mbuf_headroom(struct mbuf *mbuf);
+size_t mbuf_tailroom(struct mbuf *mbuf);
+
+int mbuf_pool_reserve(size_t size, unsigned int count);
+int mbuf_arena_init(size_t size);
+bool mbuf_arena_get(void **base, size_t *size);
+void mbuf_dump_stats(FILE *fp);
 
 #endif
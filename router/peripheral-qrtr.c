@@ -36,11 +36,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "diag.h"
 #include "diag_cntl.h"
 #include "dm.h"
+#include "mbuf.h"
+#include "peripheral.h"
 #include "peripheral-qrtr.h"
 #include "watch.h"
 #include "util.h"
@@ -95,7 +98,8 @@ static int qrtr_cntl_recv(int fd, void *data)
 		if (!perif->cntl_open) {
 			connect(perif->cntl_fd, (struct sockaddr *)&sq, sizeof(sq));
 			perif->cntl_open = true;
-			watch_add_writeq(perif->cntl_fd, &perif->cntlq);
+			watch_add_writeq(perif->cntl_fd, &perif->cntlq, NULL);
+			watch_set_name(perif->cntl_fd, perif->name);
 		}
 
 		return diag_cntl_recv(perif, pkt.data, pkt.data_len);
@@ -119,6 +123,9 @@ struct non_hdlc_pkt {
 	char payload[];
 };
 
+/* Command channels are read one message at a time, from the main loop */
+static uint8_t qrtr_cmd_buf[HDLC_BUF_SIZE];
+
 static int qrtr_cmd_recv(int fd, void *data)
 {
 	struct peripheral *perif = data;
@@ -126,13 +133,12 @@ static int qrtr_cmd_recv(int fd, void *data)
 	struct sockaddr_qrtr cmdsq;
 	struct sockaddr_qrtr sq;
 	struct qrtr_packet pkt;
-	struct circ_buf *buf = &perif->recv_buf;
         socklen_t sl;
 	ssize_t n;
 	int ret;
 
 	sl = sizeof(sq);
-	n = recvfrom(fd, buf->buf, sizeof(buf->buf), 0, (void *)&sq, &sl);
+	n = recvfrom(fd, qrtr_cmd_buf, sizeof(qrtr_cmd_buf), 0, (void *)&sq, &sl);
 	if (n < 0) {
 		ret = -errno;
 		if (ret != -ENETRESET)
@@ -140,7 +146,7 @@ static int qrtr_cmd_recv(int fd, void *data)
 		return ret;
 	}
 
-	ret = qrtr_decode(&pkt, buf->buf, n, &sq);
+	ret = qrtr_decode(&pkt, qrtr_cmd_buf, n, &sq);
 	if (ret < 0) {
 		fprintf(stderr, "[PD-MAPPER] unable to decode qrtr packet\n");
 		return ret;
@@ -180,7 +186,8 @@ static int qrtr_cmd_recv(int fd, void *data)
 		ret = connect(perif->cmd_fd, (struct sockaddr *)&cmdsq, sizeof(cmdsq));
 		if (ret < 0)
 			err(1, "failed to connect to %d:%d", cmdsq.sq_node, cmdsq.sq_port);
-		watch_add_writeq(perif->cmd_fd, &perif->cmdq);
+		watch_add_writeq(perif->cmd_fd, &perif->cmdq, NULL);
+		watch_set_name(perif->cmd_fd, perif->name);
 		break;
 	case QRTR_TYPE_DEL_SERVER:
 		watch_remove_writeq(perif->cmd_fd);
@@ -194,27 +201,142 @@ static int qrtr_cmd_recv(int fd, void *data)
 	return 0;
 }
 
+/*
+ * Data messages are received into a chain of fragments, the first one small
+ * and with headroom for framing, so that large log packets are neither
+ * truncated nor copied on their way to the DMs.
+ */
+#define QRTR_RX_HEAD_SIZE	512
+#define QRTR_RX_FRAG_SIZE	4096
+#define QRTR_RX_FRAGS		16
+
+static struct mbuf *qrtr_rx_frags[QRTR_RX_FRAGS];
+
+/* Fallback for reading control messages when the mbuf pools are exhausted */
+static uint8_t qrtr_rx_spare[QRTR_RX_HEAD_SIZE];
+
+static int qrtr_rx_refill(struct iovec *iov)
+{
+	struct mbuf *mbuf;
+	int i;
+
+	for (i = 0; i < QRTR_RX_FRAGS; i++) {
+		mbuf = qrtr_rx_frags[i];
+		if (!mbuf) {
+			if (i) {
+				mbuf = mbuf_alloc(QRTR_RX_FRAG_SIZE);
+			} else {
+				mbuf = mbuf_alloc(QRTR_RX_HEAD_SIZE);
+				if (mbuf)
+					mbuf_reserve(mbuf, DIAG_HEADROOM);
+			}
+			if (!mbuf)
+				return -ENOMEM;
+
+			qrtr_rx_frags[i] = mbuf;
+		}
+
+		iov[i].iov_base = mbuf->data;
+		iov[i].iov_len = mbuf_tailroom(mbuf);
+	}
+
+	return 0;
+}
+
+/* Detach the fragments holding the @len bytes received as a chain */
+static struct mbuf *qrtr_rx_detach(size_t len)
+{
+	struct mbuf *head = NULL;
+	struct mbuf **tail = &head;
+	struct mbuf *mbuf;
+	size_t chunk;
+	int i;
+
+	for (i = 0; i < QRTR_RX_FRAGS && len; i++) {
+		mbuf = qrtr_rx_frags[i];
+		qrtr_rx_frags[i] = NULL;
+
+		chunk = MIN(len, mbuf_tailroom(mbuf));
+		mbuf_put(mbuf, chunk);
+		len -= chunk;
+
+		*tail = mbuf;
+		tail = &mbuf->next;
+	}
+
+	return head;
+}
+
+static int qrtr_data_frame(struct mbuf *chain, size_t len)
+{
+	struct non_hdlc_pkt frame;
+	uint8_t trailer;
+
+	if (mbuf_copydata(chain, 0, sizeof(frame), &frame) < 0 ||
+	    frame.start != 0x7e || frame.version != 1) {
+		fprintf(stderr, "invalid non-HDLC frame\n");
+		return -EINVAL;
+	}
+
+	if (sizeof(frame) + frame.length + 1 > len) {
+		fprintf(stderr, "truncated non-HDLC frame\n");
+		return -EINVAL;
+	}
+
+	mbuf_copydata(chain, sizeof(frame) + frame.length, 1, &trailer);
+	if (trailer != 0x7e) {
+		fprintf(stderr, "non-HDLC frame is not truncated\n");
+		return -EINVAL;
+	}
+
+	return frame.length;
+}
+
 static int qrtr_data_recv(int fd, void *data)
 {
 	struct peripheral *perif = data;
+	struct iovec iov[QRTR_RX_FRAGS];
 	struct sockaddr_qrtr sq;
 	struct qrtr_packet pkt;
-        socklen_t sl;
-	uint8_t buf[4096];
+	struct msghdr msg = {
+		.msg_name = &sq,
+		.msg_namelen = sizeof(sq),
+		.msg_iov = iov,
+		.msg_iovlen = QRTR_RX_FRAGS,
+	};
+	bool dropping = false;
+	struct mbuf *chain;
 	ssize_t n;
 	int ret;
-	struct non_hdlc_pkt *frame;
 
-	sl = sizeof(sq);
-	n = recvfrom(fd, buf, sizeof(buf), 0, (void *)&sq, &sl);
+	/*
+	 * Should the mbuf pools be exhausted, still handle control messages,
+	 * but drop data messages, accounted by the pools, rather than tear down
+	 * the channel.
+	 */
+	ret = qrtr_rx_refill(iov);
+	if (ret < 0) {
+		iov[0].iov_base = qrtr_rx_spare;
+		iov[0].iov_len = sizeof(qrtr_rx_spare);
+		msg.msg_iovlen = 1;
+		dropping = true;
+	}
+
+	n = recvmsg(fd, &msg, MSG_TRUNC);
 	if (n < 0) {
 		ret = -errno;
 		if (ret != -ENETRESET)
-			fprintf(stderr, "[DIAG-QRTR] recvfrom failed: %d\n", ret);
+			fprintf(stderr, "[DIAG-QRTR] recvmsg failed: %d\n", ret);
 		return ret;
 	}
 
-	ret = qrtr_decode(&pkt, buf, n, &sq);
+	if ((msg.msg_flags & MSG_TRUNC) && !dropping) {
+		fprintf(stderr, "[DIAG-QRTR] dropping oversized message of %zd bytes\n", n);
+		return 0;
+	}
+
+	/* Only the packet type is needed from the decoder, look at the head */
+	ret = qrtr_decode(&pkt, iov[0].iov_base, MIN((size_t)n, iov[0].iov_len), &sq);
 	if (ret < 0) {
 		fprintf(stderr, "[PD-MAPPER] unable to decode qrtr packet\n");
 		return ret;
@@ -227,24 +349,23 @@ static int qrtr_data_recv(int fd, void *data)
 		if (!perif->data_open) {
 			connect(perif->data_fd, (struct sockaddr *)&sq, sizeof(sq));
 			perif->data_open = true;
-			watch_add_writeq(perif->data_fd, &perif->dataq);
-		}
-		frame = pkt.data;
-		if (frame->start != 0x7e || frame->version != 1) {
-			fprintf(stderr, "invalid non-HDLC frame\n");
-			break;
+			watch_add_writeq(perif->data_fd, &perif->dataq, NULL);
+			watch_set_name(perif->data_fd, perif->name);
 		}
 
-		if (sizeof(*frame) + frame->length + 1 > pkt.data_len) {
-			fprintf(stderr, "truncated non-HDLC frame\n");
+		if (dropping)
 			break;
-		}
 
-		if (frame->payload[frame->length] != 0x7e) {
-			fprintf(stderr, "non-HDLC frame is not truncated\n");
+		chain = qrtr_rx_detach(n);
+		ret = qrtr_data_frame(chain, n);
+		if (ret < 0) {
+			mbuf_free(chain);
 			break;
 		}
-		dm_broadcast(frame->payload, frame->length, perif->flow);
+
+		mbuf_pull(chain, sizeof(struct non_hdlc_pkt));
+		mbuf_trim(chain, ret);
+		dm_broadcast_mbuf(chain, perif->flow);
 		break;
 	case QRTR_TYPE_BYE:
 		watch_remove_writeq(perif->data_fd);
@@ -280,13 +401,14 @@ static int qrtr_perif_init_subsystem(const char *name, int instance_base)
 
 	perif = calloc(1, sizeof(*perif));
 
-	flow = watch_flow_new();
+	flow = peripheral_flow_new(name);
 
 	perif->name = strdup(name);
 	perif->send = qrtr_perif_send;
 	perif->close = qrtr_perif_close;
 	perif->sockets = true;
 	perif->flow = flow;
+	peripheral_budget_init(perif);
 
 	list_init(&perif->cmdq);
 	list_init(&perif->cntlq);
@@ -322,6 +444,9 @@ static int qrtr_perif_init_subsystem(const char *name, int instance_base)
 	watch_add_readfd(perif->cntl_fd, qrtr_cntl_recv, perif, NULL);
 	watch_add_readfd(perif->cmd_fd, qrtr_cmd_recv, perif, NULL);
 	watch_add_readfd(perif->data_fd, qrtr_data_recv, perif, flow);
+	watch_set_name(perif->cntl_fd, perif->name);
+	watch_set_name(perif->cmd_fd, perif->name);
+	watch_set_name(perif->data_fd, perif->name);
 	list_add(&peripherals, &perif->node);
 	return 0;
 }
@@ -49,6 +49,7 @@
 #include "diag_cntl.h"
 #include "dm.h"
 #include "hdlc.h"
+#include "ingress.h"
 #include "list.h"
 #include "peripheral.h"
 #include "util.h"
@@ -111,11 +112,17 @@ static int diag_cmd_recv(int fd, void *data)
 
 static int diag_data_recv_hdlc(int fd, struct peripheral *peripheral)
 {
+	unsigned int packets = 0;
+	size_t bytes = 0;
 	size_t msglen;
 	ssize_t n;
 	void *msg;
 
-	for (;;) {
+	/*
+	 * The budget is only checked between reads, so that no complete
+	 * frame is left in recv_buf without the channel being readable.
+	 */
+	while (!peripheral_budget_spent(peripheral, packets, bytes)) {
 		n = circ_read(fd, &peripheral->recv_buf);
 		if (n < 0)
 			return -errno;
@@ -128,26 +135,36 @@ static int diag_data_recv_hdlc(int fd, struct peripheral *peripheral)
 				break;
 
 			dm_broadcast(msg, msglen, peripheral->flow);
+
+			packets++;
+			bytes += msglen;
 		}
 	}
 
-	/* Not reached */
+	return 0;
 }
 
 static int diag_data_recv_raw(int fd, struct peripheral *peripheral)
 {
+	unsigned int packets = 0;
 	uint8_t buf[4096];
+	size_t bytes = 0;
 	ssize_t n;
 
-	for (;;) {
+	while (!peripheral_budget_spent(peripheral, packets, bytes)) {
 		n = read(fd, buf, sizeof(buf));
 		if (n < 0)
 			return -errno;
+		if (!n)
+			return -EPIPE;
 
 		dm_broadcast(buf, n, peripheral->flow);
+
+		packets++;
+		bytes += n;
 	}
 
-	/* Not reached */
+	return 0;
 }
 
 static int diag_data_recv(int fd, void *data)
@@ -323,15 +340,21 @@ static void peripheral_open(void *data)
 	if (ret < 0)
 		warn("failed to turn DIAG non blocking");
 
-	watch_add_writeq(peripheral->cntl_fd, &peripheral->cntlq);
-	watch_add_writeq(peripheral->data_fd, &peripheral->dataq);
+	watch_add_writeq(peripheral->cntl_fd, &peripheral->cntlq, NULL);
+	watch_add_writeq(peripheral->data_fd, &peripheral->dataq, NULL);
 	watch_add_readfd(peripheral->cntl_fd, rpmsg_perif_cntl_recv, peripheral, NULL);
-	watch_add_readfd(peripheral->data_fd, diag_data_recv, peripheral, peripheral->flow);
+	if (!peripheral_ingress_threads ||
+	    ingress_start(peripheral, peripheral->data_fd) < 0)
+		watch_add_readfd(peripheral->data_fd, diag_data_recv, peripheral, peripheral->flow);
 	if (peripheral->cmd_fd >= 0) {
 		watch_add_readfd(peripheral->cmd_fd, diag_cmd_recv, peripheral, NULL);
-		watch_add_writeq(peripheral->cmd_fd, &peripheral->cmdq);
+		watch_add_writeq(peripheral->cmd_fd, &peripheral->cmdq, NULL);
+		watch_set_name(peripheral->cmd_fd, peripheral->name);
 	}
 
+	watch_set_name(peripheral->cntl_fd, peripheral->name);
+	watch_set_name(peripheral->data_fd, peripheral->name);
+
 	/* Send current message mask to the newly found peripheral */
 	diag_cntl_send_masks(peripheral);
 }
@@ -340,6 +363,8 @@ static void perif_rpmsg_close(struct peripheral *peripheral)
 {
 	diag_cntl_close(peripheral);
 
+	ingress_stop(peripheral);
+
 	watch_remove_fd(peripheral->data_fd);
 	watch_remove_fd(peripheral->cntl_fd);
 	watch_remove_fd(peripheral->cmd_fd);
@@ -349,6 +374,8 @@ static void perif_rpmsg_close(struct peripheral *peripheral)
 	close(peripheral->cmd_fd);
 
 	list_del(&peripheral->node);
+	circ_release(&peripheral->recv_buf);
+	hdlc_decoder_release(&peripheral->recv_decoder);
 	free(peripheral->name);
 	free(peripheral);
 }
@@ -372,7 +399,9 @@ static int peripheral_create(const char *rproc, const char *channel)
 	peripheral = malloc(sizeof(*peripheral));
 	memset(peripheral, 0, sizeof(*peripheral));
 
-	flow = watch_flow_new();
+	circ_init(&peripheral->recv_buf, rproc, HDLC_BUF_SIZE);
+
+	flow = peripheral_flow_new(rproc);
 
 	peripheral->name = strdup(rproc);
 	peripheral->data_fd = -1;
@@ -381,6 +410,7 @@ static int peripheral_create(const char *rproc, const char *channel)
 	peripheral->send = perif_rpmsg_send;
 	peripheral->close = perif_rpmsg_close;
 	peripheral->flow = flow;
+	peripheral_budget_init(peripheral);
 	list_init(&peripheral->cmdq);
 	list_init(&peripheral->cntlq);
 	list_init(&peripheral->dataq);
@@ -478,6 +508,7 @@ int peripheral_rpmsg_init(void)
 	}
 
 	watch_add_readfd(fd, peripheral_udev_update, mon, NULL);
+	watch_set_name(fd, "udev");
 
 	return 0;
 }
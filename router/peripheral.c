@@ -42,6 +42,7 @@
 #include "diag_cntl.h"
 #include "dm.h"
 #include "hdlc.h"
+#include "ingress.h"
 #include "list.h"
 #include "peripheral.h"
 #include "peripheral-qrtr.h"
@@ -49,8 +50,188 @@
 #include "util.h"
 #include "watch.h"
 
+#define PERIPHERAL_BUDGET_PACKETS	64
+#define PERIPHERAL_BUDGET_BYTES		(64 * 1024)
+
 struct list_head peripherals = LIST_INIT(peripherals);
 
+/**
+ * struct peripheral_flow_config - flow control override for a peripheral
+ * @name:	name of the peripheral
+ * @limits:	watermarks for the peripheral's flow
+ * @node:	entry in peripheral_flow_configs
+ */
+struct peripheral_flow_config {
+	char *name;
+	struct watch_flow_limits limits;
+
+	struct list_head node;
+};
+
+static struct list_head peripheral_flow_configs = LIST_INIT(peripheral_flow_configs);
+
+/**
+ * peripheral_set_flow_limits() - configure flow control of a peripheral
+ * @name:	name of the peripheral
+ * @limits:	watermarks of data outstanding from the peripheral
+ *
+ * Applies to the named peripheral if it is already present, or as it shows
+ * up otherwise.
+ */
+void peripheral_set_flow_limits(const char *name,
+				const struct watch_flow_limits *limits)
+{
+	struct peripheral_flow_config *config;
+	struct peripheral *peripheral;
+
+	config = calloc(1, sizeof(*config));
+	if (!config)
+		err(1, "failed to allocate flow configuration");
+
+	config->name = strdup(name);
+	config->limits = *limits;
+	list_add(&peripheral_flow_configs, &config->node);
+
+	list_for_each_entry(peripheral, &peripherals, node) {
+		if (!strcmp(peripheral->name, name))
+			watch_flow_set_limits(peripheral->flow, limits);
+	}
+}
+
+/**
+ * peripheral_flow_new() - allocate flow control context for a peripheral
+ * @name:	name of the peripheral
+ *
+ * Return: flow control context, with any configured watermarks applied
+ */
+struct watch_flow *peripheral_flow_new(const char *name)
+{
+	struct peripheral_flow_config *config;
+	struct watch_flow *flow;
+
+	flow = watch_flow_new();
+	if (!flow)
+		err(1, "failed to allocate flow control context");
+
+	list_for_each_entry(config, &peripheral_flow_configs, node) {
+		if (!strcmp(config->name, name))
+			watch_flow_set_limits(flow, &config->limits);
+	}
+
+	return flow;
+}
+
+/**
+ * struct peripheral_budget_config - callback budget override for a peripheral
+ * @name:	name of the peripheral
+ * @budget:	budget for the peripheral's data channel
+ * @node:	entry in peripheral_budget_configs
+ */
+struct peripheral_budget_config {
+	char *name;
+	struct peripheral_budget budget;
+
+	struct list_head node;
+};
+
+static struct list_head peripheral_budget_configs = LIST_INIT(peripheral_budget_configs);
+
+/**
+ * peripheral_set_budget() - configure the data callback budget of a peripheral
+ * @name:	name of the peripheral
+ * @budget:	packets and bytes dispatched per callback
+ *
+ * Applies to the named peripheral if it is already present, or as it shows
+ * up otherwise.
+ */
+void peripheral_set_budget(const char *name,
+			   const struct peripheral_budget *budget)
+{
+	struct peripheral_budget_config *config;
+	struct peripheral *peripheral;
+
+	config = calloc(1, sizeof(*config));
+	if (!config)
+		err(1, "failed to allocate budget configuration");
+
+	config->name = strdup(name);
+	config->budget = *budget;
+	list_add(&peripheral_budget_configs, &config->node);
+
+	list_for_each_entry(peripheral, &peripherals, node) {
+		if (!strcmp(peripheral->name, name))
+			peripheral->budget = *budget;
+	}
+}
+
+/**
+ * peripheral_budget_init() - assign the data callback budget of a peripheral
+ * @peripheral:	the peripheral, with its name set
+ */
+void peripheral_budget_init(struct peripheral *peripheral)
+{
+	struct peripheral_budget_config *config;
+
+	peripheral->budget.packets = PERIPHERAL_BUDGET_PACKETS;
+	peripheral->budget.bytes = PERIPHERAL_BUDGET_BYTES;
+
+	list_for_each_entry(config, &peripheral_budget_configs, node) {
+		if (!strcmp(config->name, peripheral->name))
+			peripheral->budget = config->budget;
+	}
+}
+
+/**
+ * peripheral_budget_spent() - check if a data callback should yield
+ * @peripheral:	the peripheral
+ * @packets:	messages dispatched so far in this callback
+ * @bytes:	bytes dispatched so far in this callback
+ *
+ * The data channels are level triggered, so a callback that returns with
+ * data left in its channel is invoked again on the next loop iteration,
+ * after other ready watches have been serviced.
+ *
+ * Return: true if the callback has exhausted its budget
+ */
+bool peripheral_budget_spent(struct peripheral *peripheral,
+			     unsigned int packets, size_t bytes)
+{
+	const struct peripheral_budget *budget = &peripheral->budget;
+
+	if (budget->packets && packets >= budget->packets)
+		return true;
+
+	if (budget->bytes && bytes >= budget->bytes)
+		return true;
+
+	return false;
+}
+
+/**
+ * peripheral_dump_stats() - print the frames dropped by peripheral decoders
+ * @fp:		stream to print to
+ */
+void peripheral_dump_stats(FILE *fp)
+{
+	struct peripheral *peripheral;
+	unsigned long crc_errors;
+	unsigned long oversize;
+
+	fprintf(fp, "Peripherals:\n");
+
+	list_for_each_entry(peripheral, &peripherals, node) {
+		crc_errors = 0;
+		oversize = 0;
+
+		hdlc_decoder_stats(&peripheral->recv_decoder,
+				   &crc_errors, &oversize);
+		ingress_decoder_stats(peripheral, &crc_errors, &oversize);
+
+		fprintf(fp, "  %s: dropped bad crc %lu oversize %lu\n",
+			peripheral->name, crc_errors, oversize);
+	}
+}
+
 int peripheral_send(struct peripheral *peripheral, const void *ptr, size_t len)
 {
 	return peripheral->send(peripheral, ptr, len);
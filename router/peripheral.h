@@ -31,7 +31,11 @@
 #ifndef __PERIPHERAL_H__
 #define __PERIPHERAL_H__
 
+#include <stdio.h>
+
 struct diag_ssid_range_t;
+struct peripheral_budget;
+struct watch_flow_limits;
 
 int peripheral_init(void);
 void peripheral_close(struct peripheral *peripheral);
@@ -42,4 +46,16 @@ void peripheral_broadcast_msg_mask(struct diag_ssid_range_t *range);
 
 int peripheral_send(struct peripheral *peripheral, const void *ptr, size_t len);
 
+void peripheral_set_flow_limits(const char *name,
+				const struct watch_flow_limits *limits);
+struct watch_flow *peripheral_flow_new(const char *name);
+
+void peripheral_set_budget(const char *name,
+			   const struct peripheral_budget *budget);
+void peripheral_budget_init(struct peripheral *peripheral);
+bool peripheral_budget_spent(struct peripheral *peripheral,
+			     unsigned int packets, size_t bytes);
+
+void peripheral_dump_stats(FILE *fp);
+
 #endif
@@ -38,6 +38,7 @@
 #include "diag.h"
 #include "dm.h"
 #include "hdlc.h"
+#include "mbuf.h"
 #include "peripheral.h"
 #include "util.h"
 
@@ -48,18 +49,148 @@
 struct list_head fallback_cmds = LIST_INIT(fallback_cmds);
 struct list_head common_cmds = LIST_INIT(common_cmds);
 
+/* HDLC encode the message gathered from @iov into a new mbuf */
+static struct mbuf *hdlc_encode_iov_mbuf(const struct iovec *iov, int iovcnt)
+{
+	struct mbuf *mbuf;
+	size_t len;
+
+	mbuf = mbuf_alloc(hdlc_encode_size_iov(iov, iovcnt));
+	if (!mbuf)
+		return NULL;
+
+	len = hdlc_encode_iov(mbuf->data, iov, iovcnt);
+
+	/* Trim the room reserved for escaping the CRC, if unused */
+	mbuf->size = len;
+	mbuf_put(mbuf, len);
+
+	return mbuf;
+}
+
+/**
+ * hdlc_encode_mbuf() - HDLC encode a message into a mbuf
+ * @msg:	the message
+ * @msglen:	length of @msg
+ *
+ * Return: mbuf holding the encoded message, or NULL on allocation failure
+ */
+struct mbuf *hdlc_encode_mbuf(const void *msg, size_t msglen)
+{
+	struct iovec iov = { (void *)msg, msglen };
+
+	return hdlc_encode_iov_mbuf(&iov, 1);
+}
+
+/**
+ * hdlc_frame_mbuf() - HDLC encode the message of a mbuf
+ * @mbuf:	mbuf holding the message, possibly a chain of fragments
+ *
+ * The fragments are encoded in a single pass into a new mbuf.
+ *
+ * Return: mbuf holding the encoded message, or NULL on failure
+ */
+struct mbuf *hdlc_frame_mbuf(struct mbuf *mbuf)
+{
+	struct iovec iov[MBUF_MAX_FRAGS];
+	int n;
+
+	n = mbuf_iov(mbuf, iov, MBUF_MAX_FRAGS);
+	if (n < 0)
+		return NULL;
+
+	return hdlc_encode_iov_mbuf(iov, n);
+}
+
+/*
+ * HDLC frames broadcast to the DMs are packed into a shared transfer buffer,
+ * each DM is queued a clone referencing its frame. Consecutive frames are
+ * thereby contiguous and written in one flat transfer, while still being
+ * accounted and dropped individually. Frames handed out are never modified,
+ * only the room behind them is written.
+ */
+#define HDLC_BATCH_SIZE		16384
+
+static struct mbuf *hdlc_batch_mbuf;
+static struct hdlc_batch hdlc_batch;
+
+static struct mbuf *hdlc_batch_iov_mbuf(const struct iovec *iov, int iovcnt)
+{
+	struct mbuf *frame;
+	ssize_t n = -ENOSPC;
+
+	if (hdlc_batch_mbuf)
+		n = hdlc_batch_add_iov(&hdlc_batch, iov, iovcnt);
+
+	if (n == -ENOSPC) {
+		/* Large frames would leave little room to share, if any */
+		if (hdlc_encode_size_iov(iov, iovcnt) > HDLC_BATCH_SIZE / 4)
+			return hdlc_encode_iov_mbuf(iov, iovcnt);
+
+		mbuf_free(hdlc_batch_mbuf);
+		hdlc_batch_mbuf = mbuf_alloc(HDLC_BATCH_SIZE);
+		if (!hdlc_batch_mbuf)
+			return NULL;
+
+		hdlc_batch_init(&hdlc_batch, hdlc_batch_mbuf->data,
+				HDLC_BATCH_SIZE);
+		n = hdlc_batch_add_iov(&hdlc_batch, iov, iovcnt);
+	}
+
+	frame = mbuf_clone(hdlc_batch_mbuf);
+	if (!frame)
+		return NULL;
+
+	frame->data += hdlc_batch.len - n;
+	frame->size = n;
+	frame->offset = n;
+
+	return frame;
+}
+
+/**
+ * hdlc_batch_encode_mbuf() - HDLC encode a message into the broadcast batch
+ * @msg:	the message
+ * @msglen:	length of @msg
+ *
+ * Return: mbuf referencing the encoded message, or NULL on allocation failure
+ */
+struct mbuf *hdlc_batch_encode_mbuf(const void *msg, size_t msglen)
+{
+	struct iovec iov = { (void *)msg, msglen };
+
+	return hdlc_batch_iov_mbuf(&iov, 1);
+}
+
+/**
+ * hdlc_batch_frame_mbuf() - HDLC encode the message of a mbuf into the
+ * broadcast batch
+ * @mbuf:	mbuf holding the message, possibly a chain of fragments
+ *
+ * Return: mbuf referencing the encoded message, or NULL on failure
+ */
+struct mbuf *hdlc_batch_frame_mbuf(struct mbuf *mbuf)
+{
+	struct iovec iov[MBUF_MAX_FRAGS];
+	int n;
+
+	n = mbuf_iov(mbuf, iov, MBUF_MAX_FRAGS);
+	if (n < 0)
+		return NULL;
+
+	return hdlc_batch_iov_mbuf(iov, n);
+}
+
 int hdlc_enqueue_flow(struct list_head *queue, const void *msg, size_t msglen,
 		      struct watch_flow *flow)
 {
-	size_t outlen;
-	void *outbuf;
+	struct mbuf *mbuf;
 
-	outbuf = hdlc_encode(msg, msglen, &outlen);
-	if (!outbuf)
+	mbuf = hdlc_encode_mbuf(msg, msglen);
+	if (!mbuf)
 		err(1, "failed to allocate hdlc destination buffer");
 
-	queue_push_flow(queue, outbuf, outlen, flow);
-	free(outbuf);
+	queue_push_mbuf(queue, mbuf, flow);
 
 	return 0;
 }
@@ -120,18 +251,20 @@ static int diag_cmd_dispatch(struct diag_client *client, uint8_t *ptr,
 static void diag_rsp_bad_command(struct diag_client *client, uint8_t *msg,
 				 size_t len, int error_code)
 {
-	uint8_t *buf;
+	struct mbuf *mbuf;
+	uint8_t *code;
 
-	buf = malloc(len + 1);
-	if (!buf)
+	mbuf = diag_mbuf_alloc(len);
+	if (!mbuf)
 		err(1, "failed to allocate error buffer");
 
-	buf[0] = error_code;
-	memcpy(buf + 1, msg, len);
+	memcpy(mbuf_put(mbuf, len), msg, len);
 
-	dm_send(client, buf, len + 1);
+	/* The response code goes in the headroom, in front of the request */
+	code = mbuf_push(mbuf, sizeof(*code));
+	*code = error_code;
 
-	free(buf);
+	dm_send_mbuf(client, mbuf);
 }
 
 int diag_client_handle_command(struct diag_client *client, uint8_t *data, size_t len)
@@ -49,6 +49,7 @@
 #include "watch.h"
 
 #define APPS_BUF_SIZE 16384
+#define SOCKET_MAX_TRANSFER 65536
 
 int diag_sock_connect(const char *hostname, unsigned short port)
 {
@@ -82,6 +83,7 @@ int diag_sock_connect(const char *hostname, unsigned short port)
 	printf("Connected to %s:%d\n", hostname, port);
 
 	dm = dm_add("DIAG CLIENT", fd, fd, true);
+	watch_set_writeq_max_transfer(fd, SOCKET_MAX_TRANSFER);
 	dm_enable(dm);
 
 	return fd;
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <stdlib.h>
+
+#include "spsc_ring.h"
+
+/**
+ * spsc_ring_alloc() - allocate a new ring
+ * @size:	number of entries, must be a power of two
+ *
+ * Return: the new ring, or NULL on failure
+ */
+struct spsc_ring *spsc_ring_alloc(unsigned int size)
+{
+	struct spsc_ring *ring;
+
+	if (!size || (size & (size - 1))) {
+		warnx("spsc ring size %u is not a power of two", size);
+		return NULL;
+	}
+
+	ring = aligned_alloc(64, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = size - 1;
+
+	ring->slots = calloc(size, sizeof(void *));
+	if (!ring->slots) {
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void spsc_ring_free(struct spsc_ring *ring)
+{
+	if (!ring)
+		return;
+
+	free(ring->slots);
+	free(ring);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Single producer, single consumer ring of pointers. The producer owns
+ * @head and the consumer owns @tail, each only reads the other's index, so
+ * no locking is needed. The indices are kept on separate cache lines to
+ * avoid the two threads bouncing a line between them.
+ */
+struct spsc_ring {
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+
+	unsigned int mask __attribute__((aligned(64)));
+	void **slots;
+};
+
+struct spsc_ring *spsc_ring_alloc(unsigned int size);
+void spsc_ring_free(struct spsc_ring *ring);
+
+/**
+ * spsc_ring_push() - add an entry to the ring, from the producer
+ * @ring:	the ring
+ * @ptr:	entry to add
+ *
+ * Return: true on success, false if the ring is full
+ */
+static inline bool spsc_ring_push(struct spsc_ring *ring, void *ptr)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail > ring->mask)
+		return false;
+
+	ring->slots[head & ring->mask] = ptr;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+ * spsc_ring_pop() - remove the oldest entry of the ring, from the consumer
+ * @ring:	the ring
+ *
+ * Return: the oldest entry, or NULL if the ring is empty
+ */
+static inline void *spsc_ring_pop(struct spsc_ring *ring)
+{
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	void *ptr;
+
+	if (head == tail)
+		return NULL;
+
+	ptr = ring->slots[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return ptr;
+}
+
+/**
+ * spsc_ring_full() - check if the ring is full, from the producer
+ * @ring:	the ring
+ *
+ * The load is sequentially consistent, to allow the producer to publish
+ * that it is about to wait for space before checking.
+ */
+static inline bool spsc_ring_full(struct spsc_ring *ring)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+	return ring->head - tail > ring->mask;
+}
+
+#endif
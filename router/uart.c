@@ -42,6 +42,7 @@
 #include "watch.h"
 
 #define APPS_BUF_SIZE 16384
+#define UART_MAX_TRANSFER 4096
 
 static unsigned int check_baudrate(unsigned int baudrate)
 {
@@ -107,6 +108,7 @@ int diag_uart_open(const char *uartname, unsigned int baudrate)
 	printf("Connected to %s@%d\n", uartname, baudrate);
 
 	dm = dm_add("UART client", fd, fd, true);
+	watch_set_writeq_max_transfer(fd, UART_MAX_TRANSFER);
 	dm_enable(dm);
 
 	return fd;
@@ -92,6 +92,7 @@ int diag_unix_open(void)
 	}
 
 	watch_add_readfd(fd, unix_listen, NULL, NULL);
+	watch_set_name(fd, "UNIX listener");
 
 	return 0;
 }
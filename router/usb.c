@@ -59,6 +59,21 @@
 
 #define USB_PROTOCOL_DIAG	0x30
 
+/* Number of bulk-in transfers to keep queued with FunctionFS */
+#define USB_BULK_IN_DEPTH	16
+#define USB_BULK_IN_MAX_TRANSFER	16384
+
+/* Size of the bulk-out transfers read from FunctionFS */
+#define USB_BULK_OUT_MAX_TRANSFER	16384
+
+/* The USB link drains fast, allow a larger window before throttling */
+static const struct watch_flow_limits usb_flow_limits = {
+	.packets_high = 4096,
+	.packets_low = 2048,
+	.bytes_high = 2 * 1024 * 1024,
+	.bytes_low = 1024 * 1024,
+};
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define cpu_to_le16(x)		(x)
 #define cpu_to_le32(x)		(x)
@@ -278,16 +293,12 @@ err_out:
 
 static int diag_ffs_recv(struct mbuf *mbuf, void *data)
 {
-	struct circ_buf recv_buf = {0};
 	struct usb_handle *ffs = data;
 
-	memcpy(recv_buf.buf, mbuf->data, mbuf->offset);
-	recv_buf.tail = 0;
-	recv_buf.head = mbuf->offset;
-
-	dm_decode_data(ffs->dm, &recv_buf);
+	dm_recv_data(ffs->dm, mbuf->data, mbuf->offset);
 
 	mbuf->offset = 0;
+	mbuf_stamp(mbuf);
 	list_add(&ffs->outq, &mbuf->node);
 
 	return 0;
@@ -328,7 +339,7 @@ int diag_usb_open(const char *ffs_name)
 	if (!ffs)
 		err(1, "couldn't allocate usb_handle");
 
-	out_buf = mbuf_alloc(16384);
+	out_buf = mbuf_alloc(USB_BULK_OUT_MAX_TRANSFER);
 	if (!out_buf)
 		err(1, "couldn't allocate usb out buffer");
 
@@ -339,11 +350,17 @@ int diag_usb_open(const char *ffs_name)
 	}
 
 	list_init(&ffs->outq);
+	mbuf_stamp(out_buf);
 	list_add(&ffs->outq, &out_buf->node);
 
 	watch_add_readfd(ffs->ep0, ep0_recv, ffs, NULL);
+	watch_set_name(ffs->ep0, "USB ep0");
 
 	ffs->dm = dm_add("USB client", -1, ffs->bulk_in, true);
+	watch_set_writeq_depth(ffs->bulk_in, USB_BULK_IN_DEPTH);
+	watch_set_writeq_max_transfer(ffs->bulk_in, USB_BULK_IN_MAX_TRANSFER);
+	dm_set_flow_limits(ffs->dm, &usb_flow_limits);
+	dm_set_recv_size(ffs->dm, USB_BULK_OUT_MAX_TRANSFER);
 
 	return 0;
 }
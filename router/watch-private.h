@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __WATCH_PRIVATE_H__
+#define __WATCH_PRIVATE_H__
+
+#include <sys/uio.h>
+
+#include <linux/aio_abi.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+
+/* Maximum number of queued buffers gathered into a single write */
+#define WATCH_AIO_MAX_IOV	64
+
+struct mbuf;
+struct watch_flow;
+
+/**
+ * struct watch_stats - callback cost accounting
+ * @calls:	number of times the callback was invoked
+ * @total_ns:	cumulative run time of the callback
+ * @max_ns:	longest single run of the callback
+ */
+struct watch_stats {
+	unsigned long calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+/**
+ * struct watch_queue_stats - AIO queue accounting
+ * @completed:	number of buffers completed
+ * @max_inflight: highest number of requests in flight
+ * @latency_total_ns: cumulative time from allocation to completion of buffers
+ * @latency_max_ns: longest time from allocation to completion of a buffer
+ */
+struct watch_queue_stats {
+	unsigned long completed;
+	unsigned int max_inflight;
+	uint64_t latency_total_ns;
+	uint64_t latency_max_ns;
+};
+
+/**
+ * struct watch - file descriptor being watched
+ * @fd:		the file descriptor
+ * @name:	descriptive name, for statistics
+ * @fixed:	index in the io_uring registered file table, or -1
+ * @cb:		read callback, or quit callback
+ * @data:	private data passed to the callbacks
+ * @queue:	buffers to write from, or read into, for AIO watches
+ * @requeue:	buffers of failed requests, to be returned to @queue
+ * @aio_depth:	maximum number of requests in flight
+ * @aio_inflight: number of requests in flight
+ * @aio_free:	idle watch_aio objects
+ * @max_transfer: maximum size of a coalesced write, or 0 to disable
+ * @aio_offset:	bytes of the buffer at the head of @queue already written
+ * @is_write:	AIO watch is writing from @queue
+ * @aio_wait:	AIO watch must wait for the fd to become ready before retrying
+ * @enabled:	read watch is being polled
+ * @armed:	io_uring poll request is outstanding for the watch, or the fd of
+ *		the waiting AIO watch is polled
+ * @removed:	watch has been removed and is pending release
+ * @flow:	flow control context gating the read watch, or accounting the
+ *		buffers written by the write queue
+ * @flow_node:	entry in the flow's list of watches
+ * @aio_complete: AIO completion callback
+ * @stats:	cost of the read, or AIO completion, callback
+ * @qstats:	AIO queue statistics
+ * @node:	entry in the list of watches of the same kind
+ */
+struct watch {
+	int fd;
+	const char *name;
+	int fixed;
+	int (*cb)(int, void*);
+	void *data;
+
+	struct list_head *queue;
+	struct list_head requeue;
+
+	unsigned int aio_depth;
+	unsigned int aio_inflight;
+	struct list_head aio_free;
+
+	size_t max_transfer;
+	size_t aio_offset;
+
+	bool is_write;
+	bool aio_wait;
+
+	bool enabled;
+	bool armed;
+	bool removed;
+
+	struct watch_flow *flow;
+	struct list_head flow_node;
+
+	int (*aio_complete)(struct mbuf *, void*);
+
+	struct watch_stats stats;
+	struct watch_queue_stats qstats;
+
+	struct list_head node;
+};
+
+/**
+ * struct watch_aio - in-flight AIO request
+ * @iocb:	the iocb submitted, its aio_data refers back to the watch_aio
+ * @watch:	the watch the request was issued for
+ * @mbufs:	buffers being read into or written from
+ * @iov:	gather list of the request
+ * @niov:	number of entries in @iov
+ * @offset:	bytes of the first buffer written by an earlier request
+ * @node:	entry in the watch's list of idle requests
+ */
+struct watch_aio {
+	struct iocb iocb;
+	struct watch *watch;
+
+	struct list_head mbufs;
+	struct iovec iov[WATCH_AIO_MAX_IOV];
+	int niov;
+	size_t offset;
+
+	struct list_head node;
+};
+
+extern struct list_head aio_watches;
+
+uint64_t watch_now_ns(void);
+void watch_loop_wake(void);
+void watch_dispatch(struct watch *w);
+struct watch_aio *watch_aio_next(struct watch *w);
+void watch_complete_aio(struct watch_aio *aio, long res);
+
+#if HAS_IO_URING
+int watch_uring_init(void);
+void watch_uring_enable(struct watch *w);
+void watch_uring_disable(struct watch *w);
+void watch_uring_release(struct watch *w);
+int watch_uring_run_once(void);
+#else
+static inline int watch_uring_init(void)
+{
+	return -ENOSYS;
+}
+
+static inline void watch_uring_enable(struct watch *w)
+{
+}
+
+static inline void watch_uring_disable(struct watch *w)
+{
+}
+
+static inline void watch_uring_release(struct watch *w)
+{
+}
+
+static inline int watch_uring_run_once(void)
+{
+	return -ENOSYS;
+}
+#endif
+
+#endif
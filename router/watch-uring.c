@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2016, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbuf.h"
+#include "util.h"
+#include "watch.h"
+#include "watch-private.h"
+
+#define WATCH_URING_ENTRIES	256
+#define WATCH_URING_FILES	256
+
+/*
+ * The low bits of the user_data of each request tell what kind of object
+ * the remaining bits point to.
+ */
+#define URING_TAG_POLL		0	/* struct watch, readiness of a read watch */
+#define URING_TAG_RW		1	/* struct watch_aio, read or write request */
+#define URING_TAG_CANCEL	2	/* struct watch, removal of a poll request */
+#define URING_TAG_WAIT		3	/* struct watch, readiness of an AIO watch */
+#define URING_TAG_MASK		3
+
+struct uring_sq {
+	unsigned int *khead;
+	unsigned int *ktail;
+	unsigned int *kmask;
+	unsigned int *karray;
+	struct io_uring_sqe *sqes;
+
+	unsigned int tail;
+	unsigned int pending;
+};
+
+struct uring_cq {
+	unsigned int *khead;
+	unsigned int *ktail;
+	unsigned int *kmask;
+	struct io_uring_cqe *cqes;
+};
+
+static int ring_fd = -1;
+static struct uring_sq sq;
+static struct uring_cq cq;
+static unsigned int sq_entries;
+
+static bool files_registered;
+static int files[WATCH_URING_FILES];
+
+/* The mbuf arena, registered as fixed buffer 0 */
+static char *arena;
+static size_t arena_size;
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void watch_uring_register_files(void)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < WATCH_URING_FILES; i++)
+		files[i] = -1;
+
+	ret = io_uring_register(ring_fd, IORING_REGISTER_FILES, files,
+				WATCH_URING_FILES);
+	if (ret < 0) {
+		warn("failed to register io_uring file table");
+		return;
+	}
+
+	files_registered = true;
+}
+
+/*
+ * Register the mbuf arena, when the pools are served from one, as a fixed
+ * buffer. This saves the kernel from pinning and unpinning the pages of each
+ * request that reads into, or writes from, a buffer carved from the arena.
+ * The arena is locked and set up before the event loop, as registration
+ * requires.
+ */
+static void watch_uring_register_buffers(void)
+{
+	struct iovec iov;
+	void *base;
+	size_t size;
+	int ret;
+
+	if (!mbuf_arena_get(&base, &size))
+		return;
+
+	iov.iov_base = base;
+	iov.iov_len = size;
+
+	ret = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	if (ret < 0) {
+		warn("failed to register mbuf arena with io_uring");
+		return;
+	}
+
+	arena = base;
+	arena_size = size;
+}
+
+static void watch_uring_update_file(int slot, int fd)
+{
+	struct io_uring_files_update update = {
+		.offset = slot,
+		.fds = (uintptr_t)&fd,
+	};
+	int ret;
+
+	ret = io_uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE,
+				&update, 1);
+	if (ret < 0)
+		warn("failed to update io_uring file table");
+}
+
+/*
+ * Register the watch's fd in the fixed file table, saving the kernel from
+ * looking up and reference counting the file for each request. Watches
+ * that don't fit the table fall back to plain file descriptors.
+ */
+static void watch_uring_fix_file(struct watch *w)
+{
+	int i;
+
+	if (!files_registered || w->fixed >= 0)
+		return;
+
+	for (i = 0; i < WATCH_URING_FILES; i++) {
+		if (files[i] == -1)
+			break;
+	}
+
+	if (i == WATCH_URING_FILES)
+		return;
+
+	files[i] = w->fd;
+	w->fixed = i;
+
+	watch_uring_update_file(i, w->fd);
+}
+
+/**
+ * watch_uring_init() - set up the io_uring backend
+ *
+ * Return: 0 on success, negative errno if io_uring isn't usable
+ */
+int watch_uring_init(void)
+{
+	struct io_uring_params p = {};
+	size_t sq_size;
+	size_t cq_size;
+	void *sq_ring;
+	void *cq_ring;
+	void *sqes;
+	int fd;
+
+	fd = io_uring_setup(WATCH_URING_ENTRIES, &p);
+	if (fd < 0)
+		return -errno;
+
+	/* Completions must never be dropped, as buffers are tied to them */
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		close(fd);
+		return -ENOTSUP;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+	}
+
+	sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	}
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	sq.khead = sq_ring + p.sq_off.head;
+	sq.ktail = sq_ring + p.sq_off.tail;
+	sq.kmask = sq_ring + p.sq_off.ring_mask;
+	sq.karray = sq_ring + p.sq_off.array;
+	sq.sqes = sqes;
+	sq.tail = *sq.ktail;
+
+	cq.khead = cq_ring + p.cq_off.head;
+	cq.ktail = cq_ring + p.cq_off.tail;
+	cq.kmask = cq_ring + p.cq_off.ring_mask;
+	cq.cqes = cq_ring + p.cq_off.cqes;
+
+	sq_entries = p.sq_entries;
+	ring_fd = fd;
+
+	watch_uring_register_files();
+	watch_uring_register_buffers();
+
+	return 0;
+
+err_unmap_cq:
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_size);
+err_unmap_sq:
+	munmap(sq_ring, sq_size);
+err_close:
+	close(fd);
+
+	return -ENOMEM;
+}
+
+static unsigned int watch_uring_sq_space(void)
+{
+	unsigned int head = __atomic_load_n(sq.khead, __ATOMIC_ACQUIRE);
+
+	return sq_entries - (sq.tail - head);
+}
+
+/*
+ * Publish the shadow tail and hand the pending entries to the kernel,
+ * optionally waiting for completions.
+ */
+static int watch_uring_submit(unsigned int wait_nr)
+{
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	__atomic_store_n(sq.ktail, sq.tail, __ATOMIC_RELEASE);
+
+	if (!sq.pending && !wait_nr)
+		return 0;
+
+	ret = io_uring_enter(ring_fd, sq.pending, wait_nr, flags);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			return 0;
+
+		warn("failed to enter io_uring");
+		return -1;
+	}
+
+	sq.pending -= ret;
+
+	return 0;
+}
+
+/*
+ * Get a free submission queue entry, submitting the pending ones to make room
+ * if needed.
+ *
+ * Return: the zeroed entry, or NULL if the ring failed
+ */
+static struct io_uring_sqe *watch_uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (!watch_uring_sq_space() && watch_uring_submit(0) < 0)
+		return NULL;
+
+	while (!watch_uring_sq_space()) {
+		if (watch_uring_submit(1) < 0)
+			return NULL;
+	}
+
+	idx = sq.tail & *sq.kmask;
+	sqe = &sq.sqes[idx];
+	sq.karray[idx] = idx;
+	sq.tail++;
+	sq.pending++;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+static void watch_uring_prep_fd(struct io_uring_sqe *sqe, struct watch *w)
+{
+	if (w->fixed >= 0) {
+		sqe->fd = w->fixed;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = w->fd;
+	}
+}
+
+/*
+ * Requests for a single buffer within the registered arena use the fixed
+ * opcodes, vectored requests can't refer to registered buffers.
+ */
+static void watch_uring_prep_rw(struct io_uring_sqe *sqe, struct watch *w,
+				struct watch_aio *aio)
+{
+	char *base = aio->iov[0].iov_base;
+	size_t len = aio->iov[0].iov_len;
+
+	watch_uring_prep_fd(sqe, w);
+	sqe->off = -1;
+	sqe->user_data = (uintptr_t)aio | URING_TAG_RW;
+
+	if (aio->niov == 1 && arena && base >= arena &&
+	    base + len <= arena + arena_size) {
+		sqe->opcode = w->is_write ? IORING_OP_WRITE_FIXED :
+					    IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)base;
+		sqe->len = len;
+		sqe->buf_index = 0;
+		return;
+	}
+
+	sqe->opcode = w->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->addr = (uintptr_t)aio->iov;
+	sqe->len = aio->niov;
+}
+
+static struct io_uring_sqe *watch_uring_poll(struct watch *w,
+					     unsigned int events,
+					     unsigned int tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = watch_uring_get_sqe();
+	if (!sqe)
+		return NULL;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	watch_uring_prep_fd(sqe, w);
+	sqe->poll_events = events;
+	sqe->user_data = (uintptr_t)w | tag;
+
+	return sqe;
+}
+
+/**
+ * watch_uring_enable() - start polling a read watch
+ * @w:		the read watch
+ *
+ * Poll requests are one-shot, they are rearmed after each dispatch for as
+ * long as the watch remains enabled.
+ */
+void watch_uring_enable(struct watch *w)
+{
+	/* An outstanding poll, or its removal, rearms upon completion */
+	if (w->armed)
+		return;
+
+	watch_uring_fix_file(w);
+	if (watch_uring_poll(w, POLLIN, URING_TAG_POLL))
+		w->armed = true;
+}
+
+/**
+ * watch_uring_disable() - stop polling a read watch
+ * @w:		the read watch
+ */
+void watch_uring_disable(struct watch *w)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!w->armed)
+		return;
+
+	sqe = watch_uring_get_sqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)w | URING_TAG_POLL;
+	sqe->user_data = (uintptr_t)w | URING_TAG_CANCEL;
+}
+
+/**
+ * watch_uring_release() - release the io_uring resources of a removed watch
+ * @w:		the watch
+ */
+void watch_uring_release(struct watch *w)
+{
+	if (w->fixed < 0)
+		return;
+
+	files[w->fixed] = -1;
+	watch_uring_update_file(w->fixed, -1);
+	w->fixed = -1;
+}
+
+/*
+ * Issue a linked chain of up to aio_depth requests for the watch, the links
+ * keep the kernel from reordering writes to the same fd. A new chain is only
+ * started once the previous one has completed.
+ */
+static void watch_uring_queue_aio(struct watch *w)
+{
+	struct io_uring_sqe *sqe = NULL;
+	struct watch_aio *aio;
+	unsigned int n = 0;
+
+	if (w->aio_inflight || w->removed)
+		return;
+
+	/* Keep the chain within a single submission */
+	if (watch_uring_sq_space() < w->aio_depth + 1)
+		watch_uring_submit(0);
+
+	watch_uring_fix_file(w);
+
+	while (n < w->aio_depth) {
+		aio = watch_aio_next(w);
+		if (!aio)
+			break;
+
+		/* Wait for the fd to become ready after a request would block */
+		if (!n && w->aio_wait) {
+			sqe = watch_uring_poll(w, w->is_write ? POLLOUT : POLLIN,
+					       URING_TAG_WAIT);
+			if (sqe)
+				w->aio_wait = false;
+		}
+
+		if (sqe)
+			sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = watch_uring_get_sqe();
+		if (!sqe) {
+			/* Keep the buffers queued, the ring has failed */
+			watch_complete_aio(aio, -EAGAIN);
+			return;
+		}
+
+		watch_uring_prep_rw(sqe, w, aio);
+
+		n++;
+	}
+}
+
+static void watch_uring_complete(uint64_t user_data, int res)
+{
+	void *ptr = (void *)(uintptr_t)(user_data & ~URING_TAG_MASK);
+	struct watch *w = ptr;
+
+	switch (user_data & URING_TAG_MASK) {
+	case URING_TAG_POLL:
+		w->armed = false;
+
+		/* Let the callback discover any error condition on the fd */
+		if (res != -ECANCELED)
+			watch_dispatch(w);
+
+		if (w->enabled && !w->removed)
+			watch_uring_enable(w);
+		break;
+	case URING_TAG_RW:
+		watch_complete_aio(ptr, res);
+		break;
+	case URING_TAG_WAIT:
+		/* The linked requests are cancelled if the poll failed */
+		if (res < 0 && res != -ECANCELED)
+			w->aio_wait = true;
+		break;
+	case URING_TAG_CANCEL:
+		break;
+	}
+}
+
+static void watch_uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	uint64_t user_data;
+	unsigned int head;
+	unsigned int tail;
+	int res;
+
+	head = *cq.khead;
+	for (;;) {
+		tail = __atomic_load_n(cq.ktail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		cqe = &cq.cqes[head & *cq.kmask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		head++;
+
+		/* Release the slot before the handler might need more room */
+		__atomic_store_n(cq.khead, head, __ATOMIC_RELEASE);
+
+		watch_uring_complete(user_data, res);
+	}
+}
+
+/**
+ * watch_uring_run_once() - run one iteration of the io_uring event loop
+ *
+ * Queues requests for all AIO watches with pending buffers, then submits
+ * these together with any poll requests and waits for completions in a
+ * single io_uring_enter() call.
+ *
+ * Return: 0 on success, negative on fatal error
+ */
+int watch_uring_run_once(void)
+{
+	struct watch *w;
+	int ret;
+
+	list_for_each_entry(w, &aio_watches, node)
+		watch_uring_queue_aio(w);
+
+	ret = watch_uring_submit(1);
+	if (ret < 0)
+		return ret;
+
+	watch_loop_wake();
+	watch_uring_reap();
+
+	return 0;
+}
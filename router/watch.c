@@ -28,74 +28,142 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/syscall.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
-#include <linux/aio_abi.h>
-
-#include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "list.h"
 #include "mbuf.h"
 #include "util.h"
 #include "watch.h"
+#include "watch-private.h"
+
+/* Default flow control watermarks */
+#define FLOW_PACKETS_HIGH	10
+#define FLOW_PACKETS_LOW	5
+#define FLOW_BYTES_HIGH		65536
+#define FLOW_BYTES_LOW		32768
 
-#define FLOW_WATERMARK	10
+#define WATCH_MAX_EVENTS	32
+
+/* Number of iocbs the aio context can have in flight, across all watches */
+#define WATCH_AIO_NR_EVENTS	256
 
 /**
  * struct watch_flow - flow control context
- * @packets: number of outstanding packets
+ * @packets:	number of outstanding packets
+ * @bytes:	number of outstanding bytes
+ * @limits:	watermarks of the flow
+ * @blocked:	flow has crossed a high watermark and not yet drained
+ * @writeq:	flow accounts for a write queue, rather than a source
+ * @isolated:	write queue flow doesn't gate the sources of other queues
+ * @watches:	read watches gated by this flow
  */
 struct watch_flow {
-	int packets;
-};
+	unsigned int packets;
+	size_t bytes;
 
-struct watch {
-	int fd;
-	int (*cb)(int, void*);
-	void *data;
-	struct list_head *queue;
-
-	struct iocb iocb;
-	struct mbuf *pending_aio;
+	struct watch_flow_limits limits;
+	bool blocked;
+	bool writeq;
+	bool isolated;
 
-	bool is_write;
+	struct list_head watches;
+};
 
-	struct watch_flow *flow;
+typedef unsigned long aio_context_t;
 
-	int (*aio_complete)(struct mbuf *, void*);
+/**
+ * struct watch_timer_stats - cost of the timers sharing a callback
+ * @cb:		the timer callback
+ * @interval:	timeout of the most recently added timer, in milliseconds
+ * @stats:	cost of the callback
+ * @node:	entry in timer_stats
+ */
+struct watch_timer_stats {
+	void (*cb)(void *);
+	unsigned int interval;
+	struct watch_stats stats;
 
 	struct list_head node;
 };
 
-struct timer {
+/**
+ * struct watch_timer - timer context
+ * @cb:		callback to invoke upon expiry
+ * @data:	private data passed to @cb
+ * @interval:	timeout, in milliseconds
+ * @repeat:	rearm the timer after it has fired
+ * @stats:	cost of the callback, shared by the timers of the same @cb
+ * @tick:	CLOCK_MONOTONIC deadline
+ * @index:	position in the timer heap, -1 while the timer is being fired
+ * @cancelled:	timer was cancelled while being fired
+ * @next:	link in the list of expired timers
+ */
+struct watch_timer {
 	void (*cb)(void *);
 	void *data;
 	unsigned int interval;
 	bool repeat;
 
-	struct timeval tick;
+	struct watch_timer_stats *stats;
 
-	struct list_head node;
+	struct timespec tick;
+
+	int index;
+	bool cancelled;
+
+	struct watch_timer *next;
 };
 
-static struct list_head timers = LIST_INIT(timers);
+/* Binary min-heap of pending timers, ordered by deadline */
+static struct watch_timer **timer_heap;
+static unsigned int timer_count;
+static unsigned int timer_alloc;
+
+static int timer_fd = -1;
+
+/*
+ * Timer statistics are kept per callback, as one-shot timers are released
+ * as they fire.
+ */
+static struct list_head timer_stats = LIST_INIT(timer_stats);
+
+/* Loop iteration latencies are binned by the log2 of their microseconds */
+#define WATCH_HIST_BUCKETS	24
+
+static unsigned long loop_iterations;
+static unsigned long loop_hist[WATCH_HIST_BUCKETS];
+static uint64_t loop_wake_ns;
 
 static struct list_head read_watches = LIST_INIT(read_watches);
-static struct list_head aio_watches = LIST_INIT(aio_watches);
+struct list_head aio_watches = LIST_INIT(aio_watches);
 static struct list_head quit_watches = LIST_INIT(quit_watches);
+static struct list_head dead_watches = LIST_INIT(dead_watches);
 static bool do_watch_quit;
 
-typedef unsigned long aio_context_t;
+static bool watch_initialized;
+static bool use_uring;
+
+static int epoll_fd = -1;
+
+static aio_context_t aio_ctx;
+static unsigned int aio_inflight;
+static int aio_evfd = -1;
+
+/* epoll instance polling the fds of AIO watches waiting to be retried */
+static int aio_wait_fd = -1;
 
 static long io_destroy(aio_context_t ctx)
 {
@@ -125,37 +193,70 @@ static long io_submit(aio_context_t ctx, long n, struct iocb **paiocb)
 	return syscall(__NR_io_submit, ctx, n, paiocb);
 }
 
-struct watch_flow *watch_flow_new(void)
+static int watch_handle_eventfd(int evfd, void *data);
+static int watch_handle_aio_wait(int fd, void *data);
+
+uint64_t watch_now_ns(void)
 {
-	return calloc(1, sizeof(struct watch_flow));
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void watch_flow_inc(struct watch_flow *flow)
+static void watch_stats_account(struct watch_stats *stats, uint64_t start)
 {
-	if (!flow)
-		return;
+	uint64_t elapsed = watch_now_ns() - start;
 
-	flow->packets++;
+	stats->calls++;
+	stats->total_ns += elapsed;
+	if (elapsed > stats->max_ns)
+		stats->max_ns = elapsed;
 }
 
-static void watch_flow_dec(struct watch_flow *flow)
+/*
+ * Select the backend on first use, preferring io_uring when it is built in
+ * and supported by the running kernel, falling back to epoll and Linux AIO.
+ */
+static void watch_init(void)
 {
-	if (!flow)
+	int ret;
+
+	if (watch_initialized)
 		return;
 
-	if (!flow->packets)
-		fprintf(stderr, "unbalanced flow control\n");
-	else
-		flow->packets--;
-}
+	watch_initialized = true;
 
-static bool watch_flow_blocked(struct watch_flow *flow)
-{
-	return flow && flow->packets > FLOW_WATERMARK;
+	if (watch_uring_init() == 0) {
+		use_uring = true;
+		return;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		err(1, "failed to create epoll instance");
+
+	aio_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (aio_evfd < 0)
+		err(1, "failed to create eventfd");
+
+	ret = io_setup(WATCH_AIO_NR_EVENTS, &aio_ctx);
+	if (ret < 0)
+		err(1, "failed to initialize aio context");
+
+	watch_add_readfd(aio_evfd, watch_handle_eventfd, NULL, NULL);
+	watch_set_name(aio_evfd, "AIO");
+
+	aio_wait_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (aio_wait_fd < 0)
+		err(1, "failed to create epoll instance");
+
+	watch_add_readfd(aio_wait_fd, watch_handle_aio_wait, NULL, NULL);
+	watch_set_name(aio_wait_fd, "AIO wait");
 }
 
-int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
-		     struct watch_flow *flow)
+static struct watch *watch_new(int fd)
 {
 	struct watch *w;
 
@@ -164,346 +265,1444 @@ int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
 		err(1, "calloc");
 
 	w->fd = fd;
-	w->cb = cb;
-	w->data = data;
-	w->flow = flow;
+	w->fixed = -1;
+	list_init(&w->requeue);
+	list_init(&w->aio_free);
 
-	list_add(&read_watches, &w->node);
-
-	return 0;
+	return w;
 }
 
-int watch_add_readq(int fd, struct list_head *queue,
-		    int (*cb)(struct mbuf *mbuf, void *data), void *data)
+static void watch_enable(struct watch *w)
 {
-	struct watch *w;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = w,
+	};
+	int ret;
 
-	w = calloc(1, sizeof(*w));
-	if (!w)
-		err(1, "calloc");
+	if (w->enabled)
+		return;
 
-	w->fd = fd;
-	w->aio_complete = cb;
-	w->data = data;
-	w->queue = queue;
+	watch_init();
 
-	w->is_write = false;
+	if (use_uring) {
+		w->enabled = true;
+		watch_uring_enable(w);
+		return;
+	}
 
-	list_add(&aio_watches, &w->node);
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &ev);
+	if (ret < 0) {
+		warn("failed to add fd %d to epoll", w->fd);
+		return;
+	}
 
-	return 0;
+	w->enabled = true;
 }
 
-static int watch_free_write_aio(struct mbuf *mbuf, void *data)
+static void watch_disable(struct watch *w)
 {
-	watch_flow_dec(mbuf->flow);
-	free(mbuf);
+	int ret;
 
-	return 0;
+	if (!w->enabled)
+		return;
+
+	w->enabled = false;
+
+	if (use_uring) {
+		watch_uring_disable(w);
+		return;
+	}
+
+	/*
+	 * EPOLLHUP and EPOLLERR are reported even for an empty event mask, so
+	 * drop the registration altogether rather than modifying it.
+	 */
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+	if (ret < 0)
+		warn("failed to remove fd %d from epoll", w->fd);
 }
 
-int watch_add_writeq(int fd, struct list_head *queue)
+/* Number of blocked write queue flows, these gate all flow gated watches */
+static unsigned int writeq_flows_blocked;
+
+/**
+ * watch_flow_new() - allocate a new flow control context
+ *
+ * The flow is created with the default watermarks, see
+ * watch_flow_set_limits() for changing these.
+ *
+ * Return: the new flow control context, or NULL on failure
+ */
+struct watch_flow *watch_flow_new(void)
 {
-	struct watch *w;
+	struct watch_flow *flow;
 
-	w = calloc(1, sizeof(*w));
-	if (!w)
-		err(1, "calloc");
+	flow = calloc(1, sizeof(struct watch_flow));
+	if (!flow)
+		return NULL;
 
-	w->fd = fd;
-	w->queue = queue;
-	w->data = w;
+	flow->limits.packets_high = FLOW_PACKETS_HIGH;
+	flow->limits.packets_low = FLOW_PACKETS_LOW;
+	flow->limits.bytes_high = FLOW_BYTES_HIGH;
+	flow->limits.bytes_low = FLOW_BYTES_LOW;
 
-	w->aio_complete = watch_free_write_aio;
+	list_init(&flow->watches);
 
-	w->is_write = true;
+	return flow;
+}
 
-	list_add(&aio_watches, &w->node);
+/**
+ * watch_flow_bytes() - number of outstanding bytes of a flow
+ * @flow:	flow control context, may be NULL
+ *
+ * Return: number of bytes accounted against @flow and not yet released
+ */
+size_t watch_flow_bytes(struct watch_flow *flow)
+{
+	return flow ? flow->bytes : 0;
+}
 
-	return 0;
+/**
+ * watch_flow_blocked() - check if a flow is currently blocked
+ * @flow:	flow control context, may be NULL
+ *
+ * Return: true if sources gated by @flow should hold off
+ */
+bool watch_flow_blocked(struct watch_flow *flow)
+{
+	if (!flow)
+		return false;
+
+	return flow->blocked || writeq_flows_blocked;
 }
 
-void watch_remove_fd(int fd)
+static bool watch_gated(struct watch *w)
 {
-	struct list_head *item;
-	struct list_head *next;
-	struct watch *w;
+	return watch_flow_blocked(w->flow);
+}
 
-	list_for_each_safe(item, next, &read_watches) {
-		w = container_of(item, struct watch, node);
-		if (w->fd == fd) {
-			list_del(&w->node);
-			free(w);
-		}
-	}
+static void watch_regate(struct watch *w)
+{
+	if (watch_gated(w))
+		watch_disable(w);
+	else
+		watch_enable(w);
+}
 
-	list_for_each_safe(item, next, &aio_watches) {
-		w = container_of(item, struct watch, node);
-		if (w->fd == fd) {
-			list_del(&w->node);
-			free(w);
-		}
-	}
+/*
+ * A write queue backing up affects every source feeding it, unless it's
+ * isolated, so its flow gates all flow controlled watches.
+ */
+static bool watch_flow_gates_all(struct watch_flow *flow)
+{
+	return flow->writeq && !flow->isolated;
 }
 
-void watch_remove_writeq(int fd)
+static void watch_writeq_flow_blocked(bool blocked)
 {
-	struct list_head *item;
-	struct list_head *next;
 	struct watch *w;
 
-	list_for_each_safe(item, next, &aio_watches) {
-		w = container_of(item, struct watch, node);
-		if (w->fd == fd) {
-			list_del(&w->node);
-			free(w);
-		}
+	if (blocked)
+		writeq_flows_blocked++;
+	else
+		writeq_flows_blocked--;
+
+	list_for_each_entry(w, &read_watches, node) {
+		if (w->flow)
+			watch_regate(w);
 	}
 }
 
-int watch_add_quit(int (*cb)(int, void*), void *data)
+/*
+ * Block the flow once either counter exceeds its high watermark, and keep
+ * it blocked until both counters have drained to their low watermarks.
+ */
+static void watch_flow_update(struct watch_flow *flow)
 {
+	const struct watch_flow_limits *limits = &flow->limits;
 	struct watch *w;
+	bool blocked;
 
-	w = calloc(1, sizeof(struct watch));
-	if (!w)
-		err(1, "calloc");
+	if (flow->blocked)
+		blocked = flow->packets > limits->packets_low ||
+			  flow->bytes > limits->bytes_low;
+	else
+		blocked = flow->packets > limits->packets_high ||
+			  flow->bytes > limits->bytes_high;
 
-	w->cb = cb;
-	w->data = data;
+	if (blocked == flow->blocked)
+		return;
 
-	list_add(&quit_watches, &w->node);
+	flow->blocked = blocked;
 
-	return 0;
+	if (!watch_flow_gates_all(flow)) {
+		list_for_each_entry(w, &flow->watches, flow_node)
+			watch_regate(w);
+		return;
+	}
+
+	watch_writeq_flow_blocked(blocked);
 }
 
-static void watch_set_timer(struct timer *timer)
+/**
+ * watch_flow_set_limits() - configure the watermarks of a flow
+ * @flow:	flow control context
+ * @limits:	the new watermarks
+ *
+ * The flow is blocked when either the number of outstanding packets or
+ * bytes exceeds its high watermark and is unblocked when both have drained
+ * to their low watermarks.
+ */
+void watch_flow_set_limits(struct watch_flow *flow,
+			   const struct watch_flow_limits *limits)
 {
-	struct timeval now;
-	struct timeval tv;
-	int ret;
+	if (!flow)
+		return;
 
-	ret = gettimeofday(&now, NULL);
-	if (ret < 0)
-		err(1, "failed to gettimeofday");
+	if (limits->packets_low > limits->packets_high ||
+	    limits->bytes_low > limits->bytes_high) {
+		warnx("invalid flow control watermarks");
+		return;
+	}
 
-	tv.tv_sec = timer->interval / 1000;
-	tv.tv_usec = (timer->interval % 1000) * 1000;
+	flow->limits = *limits;
 
-	timeradd(&now, &tv, &timer->tick);
+	watch_flow_update(flow);
 }
 
-int watch_add_timer(void (*cb)(void *), void *data, unsigned int interval,
-		    bool repeat)
+/**
+ * watch_flow_set_isolated() - confine a write queue flow to its own queue
+ * @flow:	flow control context, may be NULL
+ * @isolated:	whether the flow blocking should leave other sources alone
+ *
+ * A blocked write queue flow normally gates all flow controlled watches.
+ * Owners of write queues that instead drop messages to bound the queue can
+ * isolate its flow, so that a stalled reader doesn't hold off every source.
+ */
+void watch_flow_set_isolated(struct watch_flow *flow, bool isolated)
 {
-	struct timer *w;
+	bool gated;
 
-	w = calloc(1, sizeof(struct timer));
-	if (!w)
-		err(1, "calloc");
-
-	w->cb = cb;
-	w->data = data;
-	w->interval = interval;
-	w->repeat = repeat;
-
-	list_add(&timers, &w->node);
+	if (!flow || flow->isolated == isolated)
+		return;
 
-	watch_set_timer(w);
+	gated = flow->blocked && watch_flow_gates_all(flow);
+	flow->isolated = isolated;
 
-	return 0;
+	if (flow->blocked && watch_flow_gates_all(flow) != gated)
+		watch_writeq_flow_blocked(!gated);
 }
 
-static void watch_free_timer(struct timer *timer)
+/**
+ * watch_flow_free() - release a flow control context
+ * @flow:	flow control context, may be NULL
+ *
+ * The flow must no longer gate any read watch, and any write queue it was
+ * passed to must have been removed.
+ */
+void watch_flow_free(struct watch_flow *flow)
 {
-	list_del(&timer->node);
-	free(timer);
+	if (!flow)
+		return;
+
+	if (flow->blocked && watch_flow_gates_all(flow))
+		watch_writeq_flow_blocked(false);
+
+	free(flow);
 }
 
-static struct timer *watch_get_next_timer()
+/**
+ * watch_flow_inc() - account a packet against a flow
+ * @flow:	flow control context, may be NULL
+ * @bytes:	size of the packet
+ */
+void watch_flow_inc(struct watch_flow *flow, size_t bytes)
 {
-	struct timeval tv;
-	struct timer *selected;
-	struct timer *timer;
+	if (!flow)
+		return;
 
-	if (list_empty(&timers))
-		return NULL;
+	flow->packets++;
+	flow->bytes += bytes;
 
-	selected = container_of(timers.next, struct timer, node);
-	tv = selected->tick;
+	watch_flow_update(flow);
+}
 
-	list_for_each_entry(timer, &timers, node) {
-		if (timercmp(&timer->tick, &tv, <)) {
-			selected = timer;
-			tv = timer->tick;
-		}
+/**
+ * watch_flow_dec() - release a packet accounted against a flow
+ * @flow:	flow control context, may be NULL
+ * @bytes:	size of the packet
+ *
+ * Packets are released by the write queues as they are written, this is for
+ * packets removed from a queue before being written.
+ */
+void watch_flow_dec(struct watch_flow *flow, size_t bytes)
+{
+	if (!flow)
+		return;
+
+	if (!flow->packets || flow->bytes < bytes) {
+		fprintf(stderr, "unbalanced flow control\n");
+		return;
 	}
 
-	return selected;
-}
+	flow->packets--;
+	flow->bytes -= bytes;
 
-void watch_quit(void)
-{
-	do_watch_quit = true;
+	watch_flow_update(flow);
 }
 
-static void watch_submit_aio(aio_context_t ioctx, int evfd, struct watch *w)
+int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
+		     struct watch_flow *flow)
 {
-	struct iocb *iocb = &w->iocb;
-	struct mbuf *mbuf;
-	int ret;
-
-	assert(!w->pending_aio);
+	struct watch *w;
 
-	if (list_empty(w->queue))
-		return;
+	w = watch_new(fd);
+	w->cb = cb;
+	w->data = data;
+	w->flow = flow;
 
-	mbuf = list_entry_first(w->queue, struct mbuf, node);
+	list_add(&read_watches, &w->node);
 
-	memset(iocb, 0, sizeof(*iocb));
-	iocb->aio_fildes = w->fd;
-	iocb->aio_lio_opcode = w->is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
-	iocb->aio_buf = (uint64_t)mbuf->data;
-	iocb->aio_nbytes = mbuf->size;
-	iocb->aio_offset = 0;
-	iocb->aio_flags = IOCB_FLAG_RESFD;
-	iocb->aio_resfd = evfd;
+	if (flow)
+		list_add(&flow->watches, &w->flow_node);
 
-	ret = io_submit(ioctx, 1, &iocb);
-	if (ret != 1)
-		fprintf(stderr, "io_submit failed: %d (%d)\n", ret, errno);
+	if (!watch_gated(w))
+		watch_enable(w);
 
-	if (ret == 1) {
-		list_del(&mbuf->node);
-		w->pending_aio = mbuf;
-	}
+	return 0;
 }
 
-static void watch_handle_eventfd(int evfd, aio_context_t ioctx)
+int watch_add_readq(int fd, struct list_head *queue,
+		    int (*cb)(struct mbuf *mbuf, void *data), void *data)
 {
-	struct io_event ev[32];
-	struct iocb *iocb;
-	struct watch *next;
 	struct watch *w;
-	uint64_t evcnt;
-	ssize_t n;
-	int count;
-	int i;
-
-	n = read(evfd, &evcnt, sizeof(evcnt));
-	if (n < 0) {
-		warn("failed to read eventfd counter");
-		return;
-	}
-
-	count = io_getevents(ioctx, 1, 32, ev, NULL);
-	list_for_each_entry_safe(w, next, &aio_watches, node) {
-		for (i = 0; i < count; i++) {
-			iocb = (struct iocb *)ev[i].obj;
-			if (iocb->aio_fildes == w->fd) {
-				assert(w->pending_aio);
 
-				if (ev[i].res == -EAGAIN)
-					continue;
+	w = watch_new(fd);
+	w->aio_complete = cb;
+	w->data = data;
+	w->queue = queue;
+	w->aio_depth = 1;
 
-				if (!w->is_write && ev[i].res >= 0)
-					w->pending_aio->offset = ev[i].res;
+	w->is_write = false;
 
-				w->aio_complete(w->pending_aio, w->data);
-				w->pending_aio = NULL;
+	list_add(&aio_watches, &w->node);
 
-				// watch_submit_aio(ioctx, evfd, w);
-			}
-		}
-	}
+	return 0;
 }
 
-void watch_run(void)
+static int watch_free_write_aio(struct mbuf *mbuf, void *data)
+{
+	struct watch *w = data;
+	size_t len = mbuf_len(mbuf);
+
+	watch_flow_dec(mbuf->flow, len);
+
+	/* The flow of a removed write queue might have been released */
+	if (!w->removed)
+		watch_flow_dec(w->flow, len);
+	mbuf_free(mbuf);
+
+	return 0;
+}
+
+int watch_add_writeq(int fd, struct list_head *queue,
+		     struct watch_flow *flow)
+{
+	struct watch *w;
+
+	w = watch_new(fd);
+	w->queue = queue;
+	w->data = w;
+	w->flow = flow;
+
+	if (flow)
+		flow->writeq = true;
+	w->aio_depth = 1;
+
+	w->aio_complete = watch_free_write_aio;
+
+	w->is_write = true;
+
+	list_add(&aio_watches, &w->node);
+
+	return 0;
+}
+
+/*
+ * Read watches might be referenced by the batch of events currently being
+ * dispatched, or by an outstanding io_uring poll request, so defer freeing
+ * them until the batch has been handled and the request has completed.
+ */
+static void watch_remove_read(struct watch *w)
+{
+	if (w->removed)
+		return;
+
+	watch_disable(w);
+	watch_uring_release(w);
+
+	if (w->flow)
+		list_del(&w->flow_node);
+
+	list_del(&w->node);
+	list_add(&dead_watches, &w->node);
+	w->removed = true;
+}
+
+static void watch_free_dead(void)
 {
-	struct timeval *timeout;
-	struct timer *timer;
-	struct timeval now;
-	struct timeval tv;
-	aio_context_t ioctx = 0;
 	struct watch *next;
 	struct watch *w;
-	fd_set rfds;
-	int evfd;
-	int nfds;
+
+	list_for_each_entry_safe(w, next, &dead_watches, node) {
+		if (w->armed)
+			continue;
+
+		list_del(&w->node);
+		free(w);
+	}
+}
+
+static void watch_free_aio(struct watch *w)
+{
+	struct watch_aio *next;
+	struct watch_aio *aio;
+	struct mbuf *mbuf;
+
+	while (!list_empty(&w->requeue)) {
+		mbuf = list_entry_first(&w->requeue, struct mbuf, node);
+		list_del(&mbuf->node);
+
+		if (w->is_write)
+			w->aio_complete(mbuf, w->data);
+		else
+			mbuf_free(mbuf);
+	}
+
+	list_for_each_entry_safe(aio, next, &w->aio_free, node)
+		free(aio);
+
+	free(w);
+}
+
+/*
+ * AIO watches with requests in flight are referenced by the aio context, so
+ * defer freeing them until the last request has completed.
+ */
+static void watch_remove_aio(struct watch *w)
+{
+	list_del(&w->node);
+	watch_uring_release(w);
+
+	/* The fd may already be closed, which removes it from the instance */
+	if (w->armed && !use_uring)
+		epoll_ctl(aio_wait_fd, EPOLL_CTL_DEL, w->fd, NULL);
+
+	if (w->aio_inflight)
+		w->removed = true;
+	else
+		watch_free_aio(w);
+}
+
+void watch_remove_fd(int fd)
+{
+	struct list_head *item;
+	struct list_head *next;
+	struct watch *w;
+
+	list_for_each_safe(item, next, &read_watches) {
+		w = container_of(item, struct watch, node);
+		if (w->fd == fd)
+			watch_remove_read(w);
+	}
+
+	list_for_each_safe(item, next, &aio_watches) {
+		w = container_of(item, struct watch, node);
+		if (w->fd == fd)
+			watch_remove_aio(w);
+	}
+}
+
+void watch_remove_writeq(int fd)
+{
+	struct list_head *item;
+	struct list_head *next;
+	struct watch *w;
+
+	list_for_each_safe(item, next, &aio_watches) {
+		w = container_of(item, struct watch, node);
+		if (w->fd == fd)
+			watch_remove_aio(w);
+	}
+}
+
+/**
+ * watch_set_writeq_depth() - set the number of in-flight writes
+ * @fd:		file descriptor of the write queue
+ * @depth:	maximum number of writes to have in flight at once
+ *
+ * Transports that complete AIO asynchronously, such as FunctionFS, can keep
+ * multiple transfers queued in the kernel to avoid idling between writes.
+ * Write queues default to a single write in flight, as on nonblocking fds a
+ * write that would block could otherwise be overtaken by a later one.
+ */
+void watch_set_writeq_depth(int fd, unsigned int depth)
+{
+	struct watch *w;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd == fd && w->is_write)
+			w->aio_depth = MAX(depth, 1);
+	}
+}
+
+/**
+ * watch_set_writeq_max_transfer() - enable coalescing of queued writes
+ * @fd:		file descriptor of the write queue
+ * @size:	maximum number of bytes to write in a single transfer
+ *
+ * Consecutive queued buffers are gathered into a single vectored write, of up
+ * to @size bytes, when they are submitted. This must only be enabled for
+ * stream based transports, as message boundaries are not retained.
+ */
+void watch_set_writeq_max_transfer(int fd, size_t size)
+{
+	struct watch *w;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd == fd && w->is_write)
+			w->max_transfer = size;
+	}
+}
+
+/**
+ * watch_set_name() - name the watches of a file descriptor
+ * @fd:		file descriptor of the watches
+ * @name:	descriptive name, must outlive the watches
+ *
+ * The name is used to identify the watches in the statistics.
+ */
+void watch_set_name(int fd, const char *name)
+{
+	struct watch *w;
+
+	list_for_each_entry(w, &read_watches, node) {
+		if (w->fd == fd)
+			w->name = name;
+	}
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd == fd)
+			w->name = name;
+	}
+}
+
+int watch_add_quit(int (*cb)(int, void*), void *data)
+{
+	struct watch *w;
+
+	w = watch_new(-1);
+	w->cb = cb;
+	w->data = data;
+
+	list_add(&quit_watches, &w->node);
+
+	return 0;
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static bool watch_timer_before(const struct watch_timer *a,
+			       const struct watch_timer *b)
+{
+	return timespec_before(&a->tick, &b->tick);
+}
+
+static void watch_timer_swap(unsigned int a, unsigned int b)
+{
+	struct watch_timer *tmp = timer_heap[a];
+
+	timer_heap[a] = timer_heap[b];
+	timer_heap[b] = tmp;
+
+	timer_heap[a]->index = a;
+	timer_heap[b]->index = b;
+}
+
+static void watch_timer_sift_up(unsigned int idx)
+{
+	unsigned int parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (!watch_timer_before(timer_heap[idx], timer_heap[parent]))
+			break;
+
+		watch_timer_swap(idx, parent);
+		idx = parent;
+	}
+}
+
+static void watch_timer_sift_down(unsigned int idx)
+{
+	unsigned int smallest;
+	unsigned int child;
+
+	for (;;) {
+		smallest = idx;
+
+		child = 2 * idx + 1;
+		if (child < timer_count &&
+		    watch_timer_before(timer_heap[child], timer_heap[smallest]))
+			smallest = child;
+
+		child++;
+		if (child < timer_count &&
+		    watch_timer_before(timer_heap[child], timer_heap[smallest]))
+			smallest = child;
+
+		if (smallest == idx)
+			break;
+
+		watch_timer_swap(idx, smallest);
+		idx = smallest;
+	}
+}
+
+static void watch_timer_push(struct watch_timer *timer)
+{
+	struct watch_timer **heap;
+
+	if (timer_count == timer_alloc) {
+		timer_alloc = timer_alloc ? timer_alloc * 2 : 16;
+
+		heap = realloc(timer_heap, timer_alloc * sizeof(*heap));
+		if (!heap)
+			err(1, "failed to grow timer heap");
+
+		timer_heap = heap;
+	}
+
+	timer->index = timer_count;
+	timer_heap[timer_count++] = timer;
+
+	watch_timer_sift_up(timer->index);
+}
+
+static void watch_timer_del(struct watch_timer *timer)
+{
+	unsigned int idx = timer->index;
+	struct watch_timer *last;
+
+	timer->index = -1;
+
+	if (idx != --timer_count) {
+		last = timer_heap[timer_count];
+		timer_heap[idx] = last;
+		last->index = idx;
+
+		watch_timer_sift_down(idx);
+		watch_timer_sift_up(last->index);
+	}
+}
+
+/* Program the timerfd to expire at the earliest deadline in the heap */
+static void watch_timer_arm(void)
+{
+	struct itimerspec its = {};
 	int ret;
 
-	evfd = eventfd(0, 0);
-	if (evfd < 0)
-		err(1, "failed to create eventfd");
+	if (timer_count)
+		its.it_value = timer_heap[0]->tick;
 
-	ret = io_setup(32, &ioctx);
+	ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
 	if (ret < 0)
-		err(1, "failed to initialize aio context");
+		err(1, "failed to arm timerfd");
+}
 
-	while (!do_watch_quit) {
-		FD_ZERO(&rfds);
-		FD_SET(evfd, &rfds);
+static void watch_timer_set_tick(struct watch_timer *timer,
+				 const struct timespec *now)
+{
+	timer->tick.tv_sec = now->tv_sec + timer->interval / 1000;
+	timer->tick.tv_nsec = now->tv_nsec + (timer->interval % 1000) * 1000000;
+	if (timer->tick.tv_nsec >= 1000000000) {
+		timer->tick.tv_sec++;
+		timer->tick.tv_nsec -= 1000000000;
+	}
+}
+
+static int watch_handle_timerfd(int fd, void *data)
+{
+	struct watch_timer *expired = NULL;
+	struct watch_timer **tail = &expired;
+	struct watch_timer *timer;
+	struct timespec now;
+	uint64_t count;
+	uint64_t start;
+	ssize_t n;
+
+	n = read(fd, &count, sizeof(count));
+	if (n < 0 && errno != EAGAIN)
+		warn("failed to read timerfd");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/*
+	 * Collect all expired timers before invoking any callbacks, so that
+	 * timers rearmed or added by the callbacks fire on a later wakeup.
+	 */
+	while (timer_count) {
+		timer = timer_heap[0];
+		if (timespec_before(&now, &timer->tick))
+			break;
 
-		nfds = evfd + 1;
+		watch_timer_del(timer);
 
-		list_for_each_entry(w, &read_watches, node) {
-			/* Skip read watches with flows that are blocked */
-			if (watch_flow_blocked(w->flow))
-				continue;
+		timer->next = NULL;
+		*tail = timer;
+		tail = &timer->next;
+	}
 
-			FD_SET(w->fd, &rfds);
+	while (expired) {
+		timer = expired;
+		expired = timer->next;
 
-			nfds = MAX(w->fd + 1, nfds);
+		if (!timer->cancelled) {
+			start = watch_now_ns();
+			timer->cb(timer->data);
+			watch_stats_account(&timer->stats->stats, start);
 		}
 
-		list_for_each_entry(w, &aio_watches, node) {
-			/* Submit AIO if none is pending */
-			if (!list_empty(w->queue) && !w->pending_aio)
-				watch_submit_aio(ioctx, evfd, w);
+		if (timer->repeat && !timer->cancelled) {
+			watch_timer_set_tick(timer, &now);
+			watch_timer_push(timer);
+		} else {
+			free(timer);
 		}
+	}
+
+	watch_timer_arm();
+
+	return 0;
+}
+
+/* Look up, or allocate, the statistics of the timers sharing @cb */
+static struct watch_timer_stats *watch_timer_stats_get(void (*cb)(void *),
+							unsigned int interval)
+{
+	struct watch_timer_stats *ts;
+
+	list_for_each_entry(ts, &timer_stats, node) {
+		if (ts->cb == cb)
+			goto out;
+	}
+
+	ts = calloc(1, sizeof(*ts));
+	if (!ts)
+		err(1, "calloc");
+
+	ts->cb = cb;
+	list_add(&timer_stats, &ts->node);
+
+out:
+	ts->interval = interval;
+
+	return ts;
+}
+
+/**
+ * watch_add_timer() - register a timer
+ * @cb:		callback to invoke upon expiry
+ * @data:	private data passed to @cb
+ * @interval:	timeout, in milliseconds
+ * @repeat:	rearm the timer after each expiry
+ *
+ * The deadline is based on CLOCK_MONOTONIC and is not affected by changes to
+ * the wall clock. A non-repeating timer is released after it has fired, so
+ * its handle must not be used beyond that point.
+ *
+ * Return: handle to be passed to watch_cancel_timer()
+ */
+struct watch_timer *watch_add_timer(void (*cb)(void *), void *data,
+				    unsigned int interval, bool repeat)
+{
+	struct watch_timer *timer;
+	struct timespec now;
+
+	if (timer_fd < 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			err(1, "failed to create timerfd");
 
-		timer = watch_get_next_timer();
-		if (timer) {
-			gettimeofday(&now, NULL);
-			timersub(&timer->tick, &now, &tv);
+		watch_add_readfd(timer_fd, watch_handle_timerfd, NULL, NULL);
+		watch_set_name(timer_fd, "timer");
+	}
+
+	timer = calloc(1, sizeof(struct watch_timer));
+	if (!timer)
+		err(1, "calloc");
+
+	timer->cb = cb;
+	timer->data = data;
+	timer->interval = interval;
+	timer->repeat = repeat;
+	timer->stats = watch_timer_stats_get(cb, interval);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	watch_timer_set_tick(timer, &now);
+	watch_timer_push(timer);
+
+	if (timer->index == 0)
+		watch_timer_arm();
+
+	return timer;
+}
+
+/**
+ * watch_cancel_timer() - cancel a pending timer
+ * @timer:	handle returned by watch_add_timer()
+ *
+ * May be called from any callback, including the timer's own.
+ */
+void watch_cancel_timer(struct watch_timer *timer)
+{
+	bool first = timer->index == 0;
+
+	/* Timer is being fired, let watch_handle_timerfd() release it */
+	if (timer->index < 0) {
+		timer->cancelled = true;
+		return;
+	}
+
+	watch_timer_del(timer);
+	free(timer);
+
+	if (first)
+		watch_timer_arm();
+}
 
-			if (tv.tv_sec < 0)
-				tv.tv_sec = tv.tv_usec = 0;
+void watch_quit(void)
+{
+	do_watch_quit = true;
+}
+
+static struct watch_aio *watch_aio_get(struct watch *w)
+{
+	struct watch_aio *aio;
+
+	if (list_empty(&w->aio_free)) {
+		aio = calloc(1, sizeof(*aio));
+		if (!aio)
+			err(1, "calloc");
+
+		aio->watch = w;
+		list_init(&aio->mbufs);
+	} else {
+		aio = list_entry_first(&w->aio_free, struct watch_aio, node);
+		list_del(&aio->node);
+	}
+
+	w->aio_inflight++;
+	if (w->aio_inflight > w->qstats.max_inflight)
+		w->qstats.max_inflight = w->aio_inflight;
+
+	return aio;
+}
 
-			timeout = &tv;
+static void watch_aio_put(struct watch_aio *aio)
+{
+	struct watch *w = aio->watch;
+
+	list_add(&w->aio_free, &aio->node);
+
+	w->aio_inflight--;
+}
+
+/*
+ * Park the buffers of a request that did not go through, they are returned
+ * to the front of the queue before the watch's next submission.
+ */
+static void watch_aio_requeue(struct watch_aio *aio)
+{
+	struct watch *w = aio->watch;
+	struct mbuf *mbuf;
+
+	if (aio->offset)
+		w->aio_offset = aio->offset;
+
+	while (!list_empty(&aio->mbufs)) {
+		mbuf = list_entry_first(&aio->mbufs, struct mbuf, node);
+		list_del(&mbuf->node);
+		list_add(&w->requeue, &mbuf->node);
+	}
+
+	watch_aio_put(aio);
+}
+
+static void watch_aio_restore(struct watch *w)
+{
+	struct mbuf *mbuf;
+
+	/*
+	 * Move the parked buffers, last first, in front of the current head of
+	 * the queue to retain their ordering.
+	 */
+	while (!list_empty(&w->requeue)) {
+		mbuf = list_entry(w->requeue.prev, struct mbuf, node);
+		list_del(&mbuf->node);
+		list_add(w->queue->next, &mbuf->node);
+	}
+}
+
+/*
+ * Merge the @n iovec entries following the first @niov into their preceding
+ * entry where contiguous in memory.
+ *
+ * Return: the number of entries remaining
+ */
+static int watch_iov_merge(struct iovec *iov, int niov, int n)
+{
+	int end = niov + n;
+	int i;
+
+	for (i = niov; i < end; i++) {
+		if (niov && (char *)iov[niov - 1].iov_base +
+			    iov[niov - 1].iov_len == iov[i].iov_base)
+			iov[niov - 1].iov_len += iov[i].iov_len;
+		else
+			iov[niov++] = iov[i];
+	}
+
+	return niov;
+}
+
+/* Skip the first @skip bytes described by the @n entries of @iov */
+static void watch_iov_advance(struct iovec *iov, int n, size_t skip)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < n && skip; i++) {
+		len = MIN(skip, iov[i].iov_len);
+		iov[i].iov_base = (char *)iov[i].iov_base + len;
+		iov[i].iov_len -= len;
+		skip -= len;
+	}
+}
+
+/**
+ * watch_aio_next() - prepare the next request for an AIO watch
+ * @w:		the AIO watch
+ *
+ * Moves the buffer at the head of the watch's queue, and for write queues
+ * with coalescing enabled as many of the following buffers as fits in a
+ * transfer, into a new request and fills out its iovec. Buffers adjacent in
+ * memory share an iovec entry.
+ *
+ * Return: the new request, or NULL if the queue is empty
+ */
+struct watch_aio *watch_aio_next(struct watch *w)
+{
+	struct watch_aio *aio;
+	struct mbuf *mbuf;
+	size_t mlen;
+	size_t len = 0;
+	int niov = 0;
+	int n;
+
+	watch_aio_restore(w);
+
+	if (list_empty(w->queue))
+		return NULL;
+
+	aio = watch_aio_get(w);
+	aio->offset = 0;
+
+	do {
+		mbuf = list_entry_first(w->queue, struct mbuf, node);
+
+		/*
+		 * Writes send the message, one iovec entry per fragment, reads
+		 * fill the available room.
+		 */
+		if (w->is_write) {
+			n = mbuf_iov(mbuf, aio->iov + niov,
+				     WATCH_AIO_MAX_IOV - niov);
+			mlen = mbuf_len(mbuf);
+
+			/* Resume a buffer partially written by a short write */
+			if (!niov && n > 0 && w->aio_offset) {
+				watch_iov_advance(aio->iov, n, w->aio_offset);
+				mlen -= w->aio_offset;
+				aio->offset = w->aio_offset;
+				w->aio_offset = 0;
+			}
 		} else {
-			timeout = NULL;
+			aio->iov[niov].iov_base = mbuf->data;
+			aio->iov[niov].iov_len = mbuf->size;
+			n = 1;
+			mlen = mbuf->size;
 		}
 
-		ret = select(nfds, &rfds, NULL, NULL, timeout);
-		if (ret < 0) {
-			warn("failed to select");
+		if (niov && (n < 0 || len + mlen > w->max_transfer))
 			break;
+
+		/* Chains are built to fit, this is not expected to happen */
+		if (n < 0)
+			errx(1, "mbuf chain exceeds %d fragments", WATCH_AIO_MAX_IOV);
+
+		list_del(&mbuf->node);
+		list_add(&aio->mbufs, &mbuf->node);
+
+		niov = w->is_write ? watch_iov_merge(aio->iov, niov, n) :
+				     niov + n;
+		len += mlen;
+	} while (w->max_transfer && niov < WATCH_AIO_MAX_IOV &&
+		 !list_empty(w->queue));
+
+	aio->niov = niov;
+
+	return aio;
+}
+
+static void watch_aio_prep(struct watch_aio *aio)
+{
+	struct iocb *iocb = &aio->iocb;
+	struct watch *w = aio->watch;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = (uintptr_t)aio;
+	iocb->aio_fildes = w->fd;
+	if (aio->niov > 1) {
+		iocb->aio_lio_opcode = IOCB_CMD_PWRITEV;
+		iocb->aio_buf = (uint64_t)aio->iov;
+		iocb->aio_nbytes = aio->niov;
+	} else {
+		iocb->aio_lio_opcode = w->is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+		iocb->aio_buf = (uint64_t)aio->iov[0].iov_base;
+		iocb->aio_nbytes = aio->iov[0].iov_len;
+	}
+	iocb->aio_offset = 0;
+	iocb->aio_flags = IOCB_FLAG_RESFD;
+	iocb->aio_resfd = aio_evfd;
+}
+
+/*
+ * Drop the rejected request at @batch[@idx], and any later requests for the
+ * same watch, from the batch and return their buffers to the queue.
+ *
+ * Return: new number of requests in the batch
+ */
+static int watch_aio_reject(struct iocb **batch, int idx, int n)
+{
+	struct watch_aio *aio;
+	struct watch *w;
+	int i;
+	int j;
+
+	aio = (struct watch_aio *)(uintptr_t)batch[idx]->aio_data;
+	w = aio->watch;
+
+	for (i = idx; i < n; i++) {
+		aio = (struct watch_aio *)(uintptr_t)batch[i]->aio_data;
+		if (aio->watch != w)
+			continue;
+
+		watch_aio_requeue(aio);
+		batch[i] = NULL;
+	}
+
+	for (i = j = idx; i < n; i++) {
+		if (batch[i])
+			batch[j++] = batch[i];
+	}
+
+	return j;
+}
+
+/*
+ * Poll the fd of an AIO watch whose last request would have blocked, the
+ * watch is not submitted to until the fd becomes ready.
+ */
+static void watch_aio_wait(struct watch *w)
+{
+	struct epoll_event ev = {
+		.events = (w->is_write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT,
+		.data.ptr = w,
+	};
+	int ret;
+
+	if (w->armed)
+		return;
+
+	ret = epoll_ctl(aio_wait_fd, EPOLL_CTL_MOD, w->fd, &ev);
+	if (ret < 0 && errno == ENOENT)
+		ret = epoll_ctl(aio_wait_fd, EPOLL_CTL_ADD, w->fd, &ev);
+	if (ret < 0) {
+		warn("failed to poll fd %d", w->fd);
+		w->aio_wait = false;
+		return;
+	}
+
+	w->armed = true;
+}
+
+/*
+ * Fill up the in-flight window of each AIO watch from its queue and submit
+ * the resulting requests to the kernel in a single io_submit() call.
+ */
+static void watch_submit_aio(void)
+{
+	struct iocb *batch[WATCH_AIO_NR_EVENTS];
+	struct watch_aio *aio;
+	struct watch *w;
+	int done = 0;
+	int ret;
+	int n = 0;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->aio_wait) {
+			watch_aio_wait(w);
+			continue;
 		}
 
-		if (ret == 0 && timer) {
-			timer->cb(timer->data);
+		while (w->aio_inflight < w->aio_depth) {
+			if (aio_inflight + n == WATCH_AIO_NR_EVENTS)
+				goto submit;
+
+			aio = watch_aio_next(w);
+			if (!aio)
+				break;
+
+			watch_aio_prep(aio);
+
+			batch[n++] = &aio->iocb;
+		}
+	}
 
-			if (timer->repeat)
-				watch_set_timer(timer);
-			else
-				watch_free_timer(timer);
+submit:
+	while (done < n) {
+		ret = io_submit(aio_ctx, n - done, &batch[done]);
+		if (ret > 0) {
+			done += ret;
+			continue;
 		}
 
-		if (FD_ISSET(evfd, &rfds))
-			watch_handle_eventfd(evfd, ioctx);
+		aio = (struct watch_aio *)(uintptr_t)batch[done]->aio_data;
+		fprintf(stderr, "io_submit failed on fd %d: %d (%d)\n",
+			aio->watch->fd, ret, errno);
+
+		n = watch_aio_reject(batch, done, n);
+	}
+
+	aio_inflight += done;
+}
+
+static void watch_queue_account(struct watch *w, struct mbuf *mbuf)
+{
+	uint64_t latency = watch_now_ns() - mbuf->stamp;
+
+	w->qstats.completed++;
+	w->qstats.latency_total_ns += latency;
+	if (latency > w->qstats.latency_max_ns)
+		w->qstats.latency_max_ns = latency;
+}
+
+/**
+ * watch_complete_aio() - handle the completion of an AIO request
+ * @aio:	the completed request
+ * @res:	result of the request
+ */
+void watch_complete_aio(struct watch_aio *aio, long res)
+{
+	struct watch *w = aio->watch;
+	struct mbuf *mbuf;
+	struct mbuf *next;
+	uint64_t start;
+	size_t done;
+	size_t len;
+
+	/*
+	 * Requests that would block, or that were cancelled as part of a
+	 * broken io_uring link chain, are retried from the queue.
+	 */
+	if ((res == -EAGAIN || res == -ECANCELED) && !w->removed) {
+		if (res == -EAGAIN)
+			w->aio_wait = true;
+
+		watch_aio_requeue(aio);
+		return;
+	}
 
-		list_for_each_entry_safe(w, next, &read_watches, node) {
-			if (FD_ISSET(w->fd, &rfds)) {
-				ret = w->cb(w->fd, w->data);
-				if (ret < 0)
-					list_del(&w->node);
+	done = res + aio->offset;
+
+	list_for_each_entry_safe(mbuf, next, &aio->mbufs, node) {
+		/*
+		 * Buffers not fully written by a short write are retried, from
+		 * where it stopped, once the fd becomes writable again.
+		 */
+		if (w->is_write && res >= 0 && !w->removed) {
+			len = mbuf_len(mbuf);
+			if (done < len) {
+				watch_aio_requeue(aio);
+				w->aio_offset = done;
+				w->aio_wait = true;
+				return;
 			}
+
+			done -= len;
+		}
+
+		list_del(&mbuf->node);
+
+		if (!w->is_write && res >= 0)
+			mbuf->offset = res;
+
+		watch_queue_account(w, mbuf);
+
+		if (w->is_write || !w->removed) {
+			start = watch_now_ns();
+			w->aio_complete(mbuf, w->data);
+			watch_stats_account(&w->stats, start);
+		} else {
+			mbuf_free(mbuf);
+		}
+	}
+
+	watch_aio_put(aio);
+
+	if (w->removed && !w->aio_inflight)
+		watch_free_aio(w);
+}
+
+static int watch_handle_eventfd(int evfd, void *data)
+{
+	struct timespec timeout = {};
+	struct io_event ev[32];
+	struct watch_aio *aio;
+	uint64_t evcnt;
+	ssize_t n;
+	long count;
+	int i;
+
+	n = read(evfd, &evcnt, sizeof(evcnt));
+	if (n < 0) {
+		warn("failed to read eventfd counter");
+		return 0;
+	}
+
+	do {
+		count = io_getevents(aio_ctx, 0, ARRAY_SIZE(ev), ev, &timeout);
+		if (count < 0) {
+			warn("failed to get aio events");
+			break;
+		}
+
+		aio_inflight -= count;
+
+		for (i = 0; i < count; i++) {
+			aio = (struct watch_aio *)(uintptr_t)ev[i].data;
+
+			watch_complete_aio(aio, ev[i].res);
 		}
+	} while (count == ARRAY_SIZE(ev));
+
+	return 0;
+}
+
+/* Retry the AIO watches whose fds have become ready */
+static int watch_handle_aio_wait(int fd, void *data)
+{
+	struct epoll_event events[WATCH_MAX_EVENTS];
+	struct watch *w;
+	int n;
+	int i;
+
+	n = epoll_wait(fd, events, WATCH_MAX_EVENTS, 0);
+	if (n < 0) {
+		warn("failed to get ready AIO watches");
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		w = events[i].data.ptr;
+		w->armed = false;
+		w->aio_wait = false;
+	}
+
+	return 0;
+}
+
+/**
+ * watch_dispatch() - invoke the callback of a readable read watch
+ * @w:		the read watch
+ */
+void watch_dispatch(struct watch *w)
+{
+	uint64_t start;
+	int ret;
+
+	/* Removed, or flow blocked, by an earlier callback */
+	if (w->removed || !w->enabled)
+		return;
+
+	start = watch_now_ns();
+	ret = w->cb(w->fd, w->data);
+	watch_stats_account(&w->stats, start);
+
+	if (ret < 0)
+		watch_remove_read(w);
+}
+
+static int watch_epoll_run_once(void)
+{
+	struct epoll_event events[WATCH_MAX_EVENTS];
+	int n;
+	int i;
+
+	watch_submit_aio();
+
+	n = epoll_wait(epoll_fd, events, WATCH_MAX_EVENTS, -1);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		warn("failed to epoll_wait");
+		return -1;
+	}
+
+	watch_loop_wake();
+
+	for (i = 0; i < n; i++)
+		watch_dispatch(events[i].data.ptr);
+
+	return 0;
+}
+
+/**
+ * watch_loop_wake() - mark the event loop as woken up
+ *
+ * Called by the backends as they return from waiting for events, the time
+ * until the iteration completes is accounted as loop latency.
+ */
+void watch_loop_wake(void)
+{
+	loop_wake_ns = watch_now_ns();
+}
+
+static void watch_loop_account(void)
+{
+	uint64_t us;
+	int bucket = 0;
+
+	if (!loop_wake_ns)
+		return;
+
+	us = (watch_now_ns() - loop_wake_ns) / 1000;
+	while (us && bucket < WATCH_HIST_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	loop_hist[bucket]++;
+	loop_iterations++;
+	loop_wake_ns = 0;
+}
+
+static void watch_dump_stats_one(FILE *fp, const char *kind, struct watch *w)
+{
+	const struct watch_stats *st = &w->stats;
+
+	fprintf(fp, "%s fd %d (%s): calls %lu total %llu us max %llu us\n",
+		kind, w->fd, w->name ? : "-", st->calls,
+		(unsigned long long)st->total_ns / 1000,
+		(unsigned long long)st->max_ns / 1000);
+}
+
+/**
+ * watch_dump_stats() - print event loop statistics
+ * @fp:		stream to print to
+ *
+ * Prints the loop iteration latency histogram, the cost of each watch and
+ * timer callback and the depth and latency of each AIO queue.
+ */
+void watch_dump_stats(FILE *fp)
+{
+	const struct watch_queue_stats *qs;
+	struct watch_timer_stats *ts;
+	unsigned long queued;
+	struct list_head *item;
+	struct watch *w;
+	uint64_t avg;
+	int i;
+
+	fprintf(fp, "loop: iterations %lu\n", loop_iterations);
+	for (i = 0; i < WATCH_HIST_BUCKETS; i++) {
+		if (!loop_hist[i])
+			continue;
+
+		fprintf(fp, "  < %lu us: %lu\n", 1UL << i, loop_hist[i]);
+	}
+
+	list_for_each_entry(w, &read_watches, node)
+		watch_dump_stats_one(fp, "read", w);
+
+	list_for_each_entry(w, &aio_watches, node) {
+		qs = &w->qstats;
+
+		queued = 0;
+		list_for_each(item, w->queue)
+			queued++;
+
+		avg = qs->completed ? qs->latency_total_ns / qs->completed : 0;
+
+		watch_dump_stats_one(fp, w->is_write ? "writeq" : "readq", w);
+		fprintf(fp, "  queued %lu inflight %u/%u (max %u) completed %lu\n",
+			queued, w->aio_inflight, w->aio_depth,
+			qs->max_inflight, qs->completed);
+		fprintf(fp, "  latency avg %llu us max %llu us\n",
+			(unsigned long long)avg / 1000,
+			(unsigned long long)qs->latency_max_ns / 1000);
+	}
+
+	list_for_each_entry(ts, &timer_stats, node) {
+		fprintf(fp, "timer %p (%u ms): calls %lu total %llu us max %llu us\n",
+			ts->cb, ts->interval, ts->stats.calls,
+			(unsigned long long)ts->stats.total_ns / 1000,
+			(unsigned long long)ts->stats.max_ns / 1000);
+	}
+}
+
+void watch_run(void)
+{
+	struct watch *w;
+	int ret;
+
+	watch_init();
+
+	while (!do_watch_quit) {
+		if (use_uring)
+			ret = watch_uring_run_once();
+		else
+			ret = watch_epoll_run_once();
+		if (ret < 0)
+			break;
+
+		watch_free_dead();
+		watch_loop_account();
 	}
 
 	list_for_each_entry(w, &quit_watches, node)
 		w->cb(-1, w->data);
 
-	io_destroy(ioctx);
+	if (!use_uring)
+		io_destroy(aio_ctx);
 }
@@ -32,28 +32,56 @@
 #define __WATCH_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include "list.h"
 
 struct mbuf;
 struct watch_flow;
+struct watch_timer;
 
 int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
 		     struct watch_flow *flow);
 int watch_add_readq(int fd, struct list_head *queue,
 		    int (*cb)(struct mbuf *mbuf, void *data), void *data);
-int watch_add_writeq(int fd, struct list_head *queue);
+int watch_add_writeq(int fd, struct list_head *queue,
+		     struct watch_flow *flow);
 void watch_remove_fd(int fd);
 void watch_remove_writeq(int fd);
+void watch_set_writeq_depth(int fd, unsigned int depth);
+void watch_set_writeq_max_transfer(int fd, size_t size);
+void watch_set_name(int fd, const char *name);
 int watch_add_quit(int (*cb)(int, void*), void *data);
-int watch_add_timer(void (*cb)(void *), void *data,
-		    unsigned int interval, bool repeat);
+struct watch_timer *watch_add_timer(void (*cb)(void *), void *data,
+				    unsigned int interval, bool repeat);
+void watch_cancel_timer(struct watch_timer *timer);
 void watch_quit(void);
 void watch_run(void);
+void watch_dump_stats(FILE *fp);
 
 
-struct watch_flow;
+/**
+ * struct watch_flow_limits - flow control watermarks
+ * @packets_high: number of outstanding packets above which the flow blocks
+ * @packets_low: number of outstanding packets to drain to before unblocking
+ * @bytes_high:	number of outstanding bytes above which the flow blocks
+ * @bytes_low:	number of outstanding bytes to drain to before unblocking
+ */
+struct watch_flow_limits {
+	unsigned int packets_high;
+	unsigned int packets_low;
+	size_t bytes_high;
+	size_t bytes_low;
+};
 
 struct watch_flow *watch_flow_new(void);
-void watch_flow_inc(struct watch_flow *flow);
+void watch_flow_set_limits(struct watch_flow *flow,
+			   const struct watch_flow_limits *limits);
+void watch_flow_set_isolated(struct watch_flow *flow, bool isolated);
+void watch_flow_free(struct watch_flow *flow);
+void watch_flow_inc(struct watch_flow *flow, size_t bytes);
+void watch_flow_dec(struct watch_flow *flow, size_t bytes);
+size_t watch_flow_bytes(struct watch_flow *flow);
+bool watch_flow_blocked(struct watch_flow *flow);
 
 #endif